@@ -4,16 +4,15 @@
 #include <aes.h>
 #include <keys.h>
 #include <flash.h>
+#include <record.h>
+#include <kv.h>
+#include <otp.h>
 #include <ch32v003fun.h>
 #include "armory.h"
 #include "secret.h"
 
 #define FLAG_BANNER "MAGICLIB"
 
-#ifndef MIN
-#define MIN(x, y) ((x < y) ? (x) : (y))
-#endif
-
 void xcryptXor(uint8_t * buf, size_t len)
 {
     for (unsigned i = 0; i < len; i++)
@@ -87,13 +86,14 @@ int parapet()
 {
     int err = -1;
     struct AES_ctx ctx;
-    char message[128];
+    // ECB, and only the first two blocks are ever printed
+    char message[AES_BLOCKLEN * 2 + 1];
 
-    flash_read(PARAPET_FLASH_ADDR, message, sizeof(message));
+    flash_read(PARAPET_FLASH_ADDR, message, AES_BLOCKLEN * 2);
 
     AES_init_ctx(&ctx, aes_key);
 
-    for (unsigned i = 0; i < sizeof(message) / AES_BLOCKLEN; ++i)
+    for (unsigned i = 0; i < 2; ++i)
     {
         AES_ECB_decrypt(&ctx, (uint8_t *)message + i * AES_BLOCKLEN);
     }
@@ -119,15 +119,10 @@ int postern()
     struct AES_ctx ctx;
     uint8_t iv[AES_BLOCKLEN] = { 0 };
     char message[128];
-    char response[128];
+    char response[sizeof(FINAL_PASSWORD)];
     size_t len;
 
-    flash_read(POSTERN_FLASH_ADDR, &len, sizeof(len));
-
-    len = MIN(len, sizeof(message));
-
-    flash_read(POSTERN_FLASH_ADDR + sizeof(len), message, len);
-    flash_read(POSTERN_FLASH_ADDR + sizeof(len) + len, response, sizeof(FINAL_PASSWORD) - 1);;
+    len = record_read(POSTERN_FLASH_ADDR, message, sizeof(message), response, sizeof(FINAL_PASSWORD) - 1);
 
     AES_init_ctx_iv(&ctx, aes_key, iv);
     AES_CBC_decrypt_buffer(&ctx, (uint8_t *)message, len);
@@ -169,11 +164,8 @@ void plunderLoad()
     uint8_t iv[AES_BLOCKLEN] = { 0 };
     size_t len;
 
-    flash_read(PLUNDER_ADDR, &len, sizeof(len));
-
     // No overflows!!!11
-    len = MIN(len, sizeof(code));
-    flash_read(PLUNDER_ADDR + sizeof(len), code, len);
+    len = record_read(PLUNDER_ADDR, code, sizeof(code), NULL, 0);
 
     AES_init_ctx_iv(&ctx, aes_key, iv);
 
@@ -194,13 +186,8 @@ void digForTreasure()
     size_t len;
     uint8_t data[512];
 
-    flash_read(PLUNDER_ADDR_DATA, &len, sizeof(len));
-
-    // Make sure it doesn't overflow
-    len = MIN(sizeof(data), len);
-
-    // Read the data
-    flash_read(PLUNDER_ADDR_DATA + sizeof(len), data, len);
+    // Read the data, making sure it doesn't overflow
+    len = record_read(PLUNDER_ADDR_DATA, data, sizeof(data), NULL, 0);
 
     // Dig!
     treasure((char *)data, len);
@@ -209,12 +196,17 @@ void digForTreasure()
 #endif // GOLD_CHALLENGE
 
 #define ATTEMPTS_ADDR           0x60000
+_Static_assert(ATTEMPTS_ADDR + KV_PAGES * KV_PAGE_SIZE <= EXT_CMDS_ADDR, "attempts store runs into the ext commands");
 #ifdef GOLD_CHALLENGE
 #define NUM_CHALLENGES 1
 #else
 #define NUM_CHALLENGES 3
 #endif
 static uint32_t attemptsList[NUM_CHALLENGES] = { 0 };
+// The counters survive reboots in a key-value store at ATTEMPTS_ADDR,
+// mounted on the first attempt
+static struct kv_s attemptsStore;
+static bool attemptsLoaded = false;
 struct __attribute__((packed)) challenge_attempts_s
 {
     char name[32];
@@ -266,8 +258,18 @@ int attempts(char * challenge)
         }
     }
 
+    if (!attemptsLoaded)
+    {
+        kv_mount(&attemptsStore, ATTEMPTS_ADDR);
+        kv_get(&attemptsStore, "attempts", attemptsList, sizeof(attemptsList));
+        attemptsLoaded = true;
+    }
+
     printf("Solve attempts: %lu\r\n", (*challenge_attempts.pattempts)++);
 
+    // A full store or a busy chip only costs this count after a reboot
+    kv_put(&attemptsStore, "attempts", attemptsList, sizeof(attemptsList));
+
     err = 0;
 error:
     return err;
@@ -282,8 +284,8 @@ int persuasion()
     uint8_t message[sizeof(PERSUASION) - 1] = { 0 };
 
     // Read
-    flash_read_ext(PERSUASION_KEY_FLASH_ADDR, k, sizeof(k));
-    flash_read_ext(PERSUASION_KEY_FLASH_ADDR + sizeof(k), message, sizeof(k));
+    otp_read(PERSUASION_KEY_FLASH_ADDR, k, sizeof(k));
+    otp_read(PERSUASION_KEY_FLASH_ADDR + sizeof(k), message, sizeof(k));
 
     // Decrypt
     xcryptXorKey((uint8_t *)message, sizeof(message), k);
@@ -304,10 +306,7 @@ static void persuasionSetup()
     printf("Running %s...\r\n", __FUNCTION__);
 
     // Sort out the flash
-    flash_erase_block(0x70000);
-    Delay_Ms(1);
-
-    flash_write(0x70000, tmp, sizeof(tmp));
+    flash_update(0x70000, tmp, sizeof(tmp));
 
     // Delay a bit
 	Delay_Ms(1);
@@ -317,10 +316,13 @@ static void persuasionSetup()
 
     // xcryptXorKey((uint8_t *)message, sizeof(message), k);
 
-    flash_erase_block_ext(PERSUASION_KEY_FLASH_ADDR);
+    otp_erase(PERSUASION_KEY_FLASH_ADDR);
 
     // Write encryption key to flash
-    flash_write_ext(PERSUASION_KEY_FLASH_ADDR, k, sizeof(k));
+    otp_write(PERSUASION_KEY_FLASH_ADDR, k, sizeof(k));
+
+    // Out before the opcodes change under the mirror
+    otp_flush();
 
     // Setup The write commands
     struct _ext_cmds_s cmds = {
@@ -329,11 +331,7 @@ static void persuasionSetup()
         .erase = 0x52,
     };
 
-    flash_erase_block(EXT_CMDS_ADDR);
-
-    Delay_Ms(1);
-
-    flash_write(EXT_CMDS_ADDR, &cmds, sizeof(struct _ext_cmds_s));
+    flash_update(EXT_CMDS_ADDR, &cmds, sizeof(struct _ext_cmds_s));
 
     // Wait a bit
     Delay_Ms(1);
@@ -344,20 +342,23 @@ static void persuasionSetup()
     // Make sure it's written
     uint8_t kk[] = PERSUAISON_KEY;
 
-    flash_erase_block_ext(PERSUASION_KEY_FLASH_ADDR);
+    otp_erase(PERSUASION_KEY_FLASH_ADDR);
 
     // Write
-    flash_write_ext(PERSUASION_KEY_FLASH_ADDR, kk, sizeof(kk));
+    otp_write(PERSUASION_KEY_FLASH_ADDR, kk, sizeof(kk));
 
     printf("Setting up message...\r\n");
 
     // Write message
-    flash_write_ext(PERSUASION_KEY_FLASH_ADDR + sizeof(kk), message, sizeof(message) - 1);
+    otp_write(PERSUASION_KEY_FLASH_ADDR + sizeof(kk), message, sizeof(message) - 1);
+    otp_flush();
 }
 
 #else
 
-static void palisadeSetup()
+// Each stage builds the record it keeps in flash into buf and returns
+// its length. setupProgram() writes it to the stage's freshly erased block.
+static size_t palisadeSetup(uint8_t * buf)
 {
     char message[] = FLAG_BANNER "{No one can break this! " S(PARAPET_FLASH_ADDR) "}";
     size_t len;
@@ -373,11 +374,12 @@ static void palisadeSetup()
     *((uint32_t *)(message)) = 0x00000000; // random(0xffffffff);
 
     // Write the first flag to its corresponding address
-    flash_erase_block(PALISADE_FLASH_ADDR);
-    flash_write(PALISADE_FLASH_ADDR, message, len);
+    memcpy(buf, message, len);
+
+    return len;
 }
 
-static void parapetSetup()
+static size_t parapetSetup(uint8_t * buf)
 {
     struct AES_ctx ctx;
     char message[128] = "Important message to transmit - " FLAG_BANNER "{53Cr37 5745H: " S(POSTERN_FLASH_ADDR) "}";
@@ -398,34 +400,39 @@ static void parapetSetup()
     }
 
     // Write buffer to flash
-    flash_erase_block(PARAPET_FLASH_ADDR);
-    flash_write(PARAPET_FLASH_ADDR, message, len);
+    memcpy(buf, message, len);
+
+    return len;
 }
 
-static void posternSetup()
+static size_t posternSetup(uint8_t * buf)
 {
     struct AES_ctx ctx;
     uint8_t iv[AES_BLOCKLEN] = { 0 };
-    char message[128] = FLAG_BANNER "{Passwd: " FINAL_PASSWORD "}";
-    size_t len;
+    // Length and body go out as one record
+    struct __attribute__((packed))
+    {
+        size_t len;
+        char message[128];
+    } rec = { .message = FLAG_BANNER "{Passwd: " FINAL_PASSWORD "}" };
 
     printf("Running %s...\r\n", __FUNCTION__);
 
     // Initialize AES context
     AES_init_ctx_iv(&ctx, aes_key, iv);
 
-    len = PKCS7Pad((uint8_t *)message, strlen(message));
+    rec.len = PKCS7Pad((uint8_t *)rec.message, strlen(rec.message));
 
     // Encrypt
-    AES_CBC_encrypt_buffer(&ctx, (uint8_t *)message, len);
+    AES_CBC_encrypt_buffer(&ctx, (uint8_t *)rec.message, rec.len);
 
     // Oops... Something bad happened...
-    message[len - AES_BLOCKLEN - 1] = '\0';
+    rec.message[rec.len - AES_BLOCKLEN - 1] = '\0';
 
     // Write buffer to flash
-    flash_erase_block(POSTERN_FLASH_ADDR);
-    flash_write(POSTERN_FLASH_ADDR, &len, sizeof(len));
-    flash_write(POSTERN_FLASH_ADDR + sizeof(len), message, len);
+    memcpy(buf, &rec, sizeof(rec.len) + rec.len);
+
+    return sizeof(rec.len) + rec.len;
 }
 
 typedef size_t (* printfptr)(const char *);
@@ -451,46 +458,129 @@ int __attribute__((naked)) theSwordOfSecrets(printfptr ext_println, char * flag)
     __asm__("ret");
 }
 
-static void prizeSetup()
+static size_t prizeSetup(uint8_t * buf)
 {
-    uint8_t code[128];
     uint8_t iv[AES_BLOCKLEN] = { 0 };
-    size_t code_len = 50;
     struct AES_ctx ctx;
+    // Length and code go out as one record
+    struct __attribute__((packed))
+    {
+        size_t len;
+        uint8_t code[128];
+    } rec = { .len = 50 };
 
     printf("Running %s...\r\n", __FUNCTION__);
 
-    memcpy(code, (void *)theSwordOfSecrets, code_len);
+    memcpy(rec.code, (void *)theSwordOfSecrets, rec.len);
 
     // Initialize AES context
     AES_init_ctx_iv(&ctx, aes_key, iv);
 
-    code_len = PKCS7Pad(code, code_len);
+    rec.len = PKCS7Pad(rec.code, rec.len);
 
     // Encrypt
-    AES_CBC_encrypt_buffer(&ctx, code, code_len);
+    AES_CBC_encrypt_buffer(&ctx, rec.code, rec.len);
 
 
     // Write buffer to flash
-    flash_erase_block(PLUNDER_ADDR);
-    flash_write(PLUNDER_ADDR, &code_len, sizeof(code_len));
-    flash_write(PLUNDER_ADDR + sizeof(code_len), code, code_len);
+    memcpy(buf, &rec, sizeof(rec.len) + rec.len);
+
+    return sizeof(rec.len) + rec.len;
+}
+
+// RESET runs the stages one after the other from the flash job queue.
+// Each stage's whole block is erased, as anything a player wrote next to
+// the record has to go too, then the record is built and programmed from
+// the erase's callback. Every callback queues the next job into the slot
+// its own job just freed, and the stages take turns with one buffer.
+#define SETUP_IDLE 0xFF
+
+static const struct
+{
+    uint32_t addr;
+    size_t (* build)(uint8_t * buf);
+} setupStages[] = {
+    { PALISADE_FLASH_ADDR, palisadeSetup },
+    { PARAPET_FLASH_ADDR, parapetSetup },
+    { POSTERN_FLASH_ADDR, posternSetup },
+    { PLUNDER_ADDR, prizeSetup },
+};
+
+#define SETUP_STAGES (sizeof(setupStages) / sizeof(setupStages[0]))
+
+static uint8_t setupBuf[sizeof(size_t) + 128];
+static uint8_t setupStage = SETUP_IDLE;
+
+static void setupProgram();
+static void setupNext();
+
+static void setupFail()
+{
+    printf("Quest setup interrupted, RESET again" "\r\n");
+
+    setupStage = SETUP_IDLE;
+}
+
+static void setupErase()
+{
+    if (flash_job_erase(setupStages[setupStage].addr, setupProgram) < 0)
+    {
+        setupFail();
+    }
+}
+
+static void setupProgram()
+{
+    size_t len = setupStages[setupStage].build(setupBuf);
+
+    if (flash_job_program(setupStages[setupStage].addr, setupBuf, len, setupNext) < 0)
+    {
+        setupFail();
+    }
+}
+
+static void setupNext()
+{
+    if (++setupStage == SETUP_STAGES)
+    {
+        printf("Done." "\r\n");
+
+        setupStage = SETUP_IDLE;
+
+        return;
+    }
+
+    setupErase();
 }
 
 #endif // GOLD_CHALLENGE
 
-void setupQuest()
+bool setupQuestReady()
 {
 #ifdef GOLD_CHALLENGE
-    persuasionSetup();
+    return true;
 #else
-    palisadeSetup();
+    // Not while the last reset is still being written, or while the queue
+    // can't take the first erase
+    return setupStage == SETUP_IDLE && flash_job_free();
+#endif
+}
 
-    parapetSetup();
+int setupQuest()
+{
+    if (!setupQuestReady())
+    {
+        return -1;
+    }
 
-    posternSetup();
+#ifdef GOLD_CHALLENGE
+    persuasionSetup();
 
-    prizeSetup();
-#endif
     printf("Done." "\r\n");
+#else
+    setupStage = 0;
+    setupErase();
+#endif
+
+    return 0;
 }
@@ -1,12 +1,15 @@
 #ifndef __SECBOOT_H__
 #define __SECBOOT_H__
 
+#include <stdbool.h>
+
 // #define SETUP
 // #define SOLVE
 
 // #ifdef SETUP
 
-void setupQuest();
+int setupQuest();
+bool setupQuestReady();
 
 // #else
 
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ch32v003fun.h>
+#include <flash.h>
+#include <asset.h>
+
+// Packed bytes come off a flash stream 16 at a time, so the command and
+// address only go out once per asset
+struct asset_in_s
+{
+    uint8_t buf[16];
+    uint8_t pos;
+    uint8_t len;
+};
+
+// The window doubles as the UART buffer: bytes from start up to w haven't
+// been written out yet. It's written every time w wraps, and at the end.
+struct asset_out_s
+{
+    char window[ASSET_WINDOW];
+    uint8_t w;
+    uint8_t start;
+};
+
+static int asset_byte(struct asset_in_s * in)
+{
+    if (in->pos == in->len)
+    {
+        in->len = flash_stream_read(in->buf, sizeof(in->buf));
+        in->pos = 0;
+
+        if (!in->len)
+        {
+            return -1;
+        }
+    }
+
+    return in->buf[in->pos++];
+}
+
+static void asset_flush(struct asset_out_s * out, unsigned end)
+{
+    if (end > out->start)
+    {
+        _write(0, out->window + out->start, end - out->start);
+    }
+    out->start = end & (ASSET_WINDOW - 1);
+}
+
+static void asset_emit(struct asset_out_s * out, uint8_t c)
+{
+    out->window[out->w] = c;
+
+    if (out->w == ASSET_WINDOW - 1)
+    {
+        asset_flush(out, ASSET_WINDOW);
+    }
+    out->w = (out->w + 1) & (ASSET_WINDOW - 1);
+}
+
+static bool asset_expand(struct asset_in_s * in, struct asset_out_s * out, uint16_t left)
+{
+    int flags = 0, bits = 0, c, dist, len;
+
+    while (left)
+    {
+        if (!bits)
+        {
+            if ((flags = asset_byte(in)) < 0)
+            {
+                return false;
+            }
+            bits = 8;
+        }
+
+        if (flags & 1)
+        {
+            if ((c = asset_byte(in)) < 0)
+            {
+                return false;
+            }
+            asset_emit(out, c);
+            left--;
+        }
+        else
+        {
+            if ((dist = asset_byte(in)) < 0 || (len = asset_byte(in)) < 0)
+            {
+                return false;
+            }
+            dist += 1;
+            len += ASSET_MIN_MATCH;
+
+            // overlapping matches are fine, they read what they just wrote
+            for (; len && left; len--, left--)
+            {
+                asset_emit(out, out->window[(out->w - dist) & (ASSET_WINDOW - 1)]);
+            }
+        }
+
+        flags >>= 1;
+        bits--;
+    }
+
+    return true;
+}
+
+bool asset_print(uint8_t id)
+{
+    struct asset_hdr_s h;
+    struct asset_entry_s e;
+    struct asset_in_s in;
+    struct asset_out_s out;
+    bool ok;
+
+    // no chip select before flash_init(), reading would never finish
+    if (flash_dev->cs < 0)
+    {
+        return false;
+    }
+
+    flash_read(ASSET_ADDR, &h, sizeof(h));
+
+    if (h.magic != ASSET_MAGIC || id >= h.count)
+    {
+        return false;
+    }
+
+    flash_read(ASSET_ADDR + sizeof(h) + id * sizeof(e), &e, sizeof(e));
+
+    in.pos = 0;
+    in.len = 0;
+    out.w = 0;
+    out.start = 0;
+
+    flash_stream_open(ASSET_ADDR + e.offset, e.packed);
+    ok = asset_expand(&in, &out, e.size);
+    flash_stream_close();
+    asset_flush(&out, out.w);
+
+    return ok;
+}
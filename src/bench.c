@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ch32v003fun.h>
+#include <flash.h>
+#include <bench.h>
+
+#if FLASH_BENCH
+
+#define BENCH_BUCKETS 10 // <4us, <16us ... <262144us, more
+
+struct bench_s
+{
+    const char * name;
+    uint32_t bytes;     // per sample
+    uint8_t count;
+    uint32_t ticks[BENCH_SAMPLES];
+};
+
+static uint32_t rnd;
+
+static uint32_t benchRandom()
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+
+    return rnd;
+}
+
+static void benchIdle()
+{
+    flash_job_flush();
+    while (flash_is_busy());
+}
+
+static void benchReport(struct bench_s * b)
+{
+    uint32_t total = 0, us, t;
+    uint8_t hist[BENCH_BUCKETS] = { 0 };
+    unsigned i, j, rate;
+
+    // insertion sort, for the median
+    for (i = 1; i < b->count; i++)
+    {
+        t = b->ticks[i];
+        for (j = i; j > 0 && b->ticks[j - 1] > t; j--)
+        {
+            b->ticks[j] = b->ticks[j - 1];
+        }
+        b->ticks[j] = t;
+    }
+
+    for (i = 0; i < b->count; i++)
+    {
+        total += b->ticks[i];
+        us = b->ticks[i] / DELAY_US_TIME;
+        for (j = 0; j < BENCH_BUCKETS - 1 && us >= (4ul << (j * 2)); j++);
+        hist[j]++;
+    }
+
+    // bytes per us is MB/s, two decimals
+    us = total / DELAY_US_TIME;
+    rate = us ? (b->bytes * b->count * 100) / us : 0;
+
+    // mini printf has no left alignment, names go last
+    printf("%7lu %7lu %7lu us", b->ticks[0] / DELAY_US_TIME,
+        b->ticks[b->count / 2] / DELAY_US_TIME,
+        b->ticks[b->count - 1] / DELAY_US_TIME);
+    printf(" %3u.%02u MB/s  %s\r\n   ", rate / 100, rate % 100, b->name);
+    for (j = 0; j < BENCH_BUCKETS; j++)
+    {
+        if (!hist[j])
+        {
+            continue;
+        }
+        if (j < BENCH_BUCKETS - 1)
+        {
+            printf(" <%luus:%u", 4ul << (j * 2), hist[j]);
+        }
+        else
+        {
+            printf(" more:%u", hist[j]);
+        }
+    }
+    printf("\r\n");
+}
+
+static void benchRead(uint8_t * buf, uint32_t size, int sequential)
+{
+    struct bench_s b = { .name = sequential ? "read seq" : "read random", .bytes = size };
+    char name[16];
+    uint32_t addr = 0, start;
+
+    for (b.count = 0; b.count < BENCH_SAMPLES; b.count++)
+    {
+        addr = sequential ? addr + size : benchRandom() % (flash_dev->geom.size - size);
+        start = SysTick->CNT;
+        flash_read(addr, buf, size);
+        b.ticks[b.count] = SysTick->CNT - start;
+    }
+
+    snprintf(name, sizeof(name), "%s %lu", b.name, size);
+    b.name = name;
+    benchReport(&b);
+}
+
+static void benchStream(uint8_t * buf, uint32_t chunk)
+{
+    struct bench_s b = { .name = "stream 64K", .bytes = 0x10000 };
+    uint32_t start;
+
+    for (b.count = 0; b.count < 4; b.count++)
+    {
+        start = SysTick->CNT;
+        flash_stream_open(b.count * 0x10000, 0x10000);
+        while (flash_stream_read(buf, chunk));
+        flash_stream_close();
+        b.ticks[b.count] = SysTick->CNT - start;
+    }
+
+    benchReport(&b);
+}
+
+static void benchProgram(uint8_t * buf)
+{
+    struct bench_s b = { .name = "program 256", .bytes = 256 };
+    uint32_t start;
+
+    flash_erase_range(BENCH_FLASH_ADDR, BENCH_SAMPLES * 256);
+    benchIdle();
+    for (b.count = 0; b.count < BENCH_SAMPLES; b.count++)
+    {
+        memset(buf, b.count, 256);
+        start = SysTick->CNT;
+        flash_write(BENCH_FLASH_ADDR + b.count * 256, buf, 256);
+        while (flash_is_busy());
+        b.ticks[b.count] = SysTick->CNT - start;
+    }
+
+    benchReport(&b);
+}
+
+static void benchErase()
+{
+    struct bench_s b = { .bytes = 0 };
+    char name[16];
+    uint32_t size, start;
+
+    for (unsigned i = 0; i < 4; i++)
+    {
+        if (!flash_dev->geom.erase_op[i] || flash_dev->geom.erase_shift[i] > 16)
+        {
+            continue;
+        }
+        size = 1ul << flash_dev->geom.erase_shift[i];
+        for (b.count = 0; b.count < 4; b.count++)
+        {
+            start = SysTick->CNT;
+            flash_erase_range(BENCH_FLASH_ADDR, size);
+            while (flash_is_busy());
+            b.ticks[b.count] = SysTick->CNT - start;
+        }
+        b.bytes = size;
+        snprintf(name, sizeof(name), "erase %luK", size >> 10);
+        b.name = name;
+        benchReport(&b);
+    }
+}
+
+void benchFlash()
+{
+    static const uint16_t sizes[] = { 4, 32, 256 };
+    uint8_t buf[256];
+
+    rnd = SysTick->CNT | 1;
+    benchIdle();
+
+    printf("    min  median     max\r\n");
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        benchRead(buf, sizes[i], 1);
+        benchRead(buf, sizes[i], 0);
+    }
+    benchStream(buf, sizeof(buf));
+    benchProgram(buf);
+    benchErase();
+
+    flash_print_stats();
+}
+
+#endif // FLASH_BENCH
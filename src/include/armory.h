@@ -1,7 +1,11 @@
 #ifndef __SECBOOT_H__
 #define __SECBOOT_H__
 
-void setupQuest();
+#include <stdbool.h>
+
+// Queues the stages on the flash job queue, -1 if that can't be done now
+int setupQuest();
+bool setupQuestReady();
 
 int palisade();
 int parapet();
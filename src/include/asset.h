@@ -0,0 +1,64 @@
+#ifndef __ASSET_H__
+#define __ASSET_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Large strings packed into external flash by src/tool/pack_assets.py and
+// expanded straight to the UART. The packer reads the ASSET_* list below:
+// ID, then the string macro stored under it and the header defining it
+// (keys.h if none).
+#define ASSET_INTRO     0   // INTRO_MESSAGE
+#define ASSET_MINIGAME  1   // MINIGAME_BANNER minigame.h
+#define ASSET_TOO_LONG  2   // MINIGAME_TOO_LONG minigame.h
+
+// Where the packed blob lives, clear of the challenge records
+#ifndef ASSET_ADDR
+#define ASSET_ADDR 0xE00000
+#endif
+
+// Print banners from the blob instead of building them into the firmware.
+// Off by default: a badge only has the blob once `make assets` wrote it to
+// ASSET_ADDR, and the minigame banner comes up before flash_init().
+#ifndef ASSETS_IN_FLASH
+#define ASSETS_IN_FLASH 0
+#endif
+
+#define ASSET_MAGIC     0x54455341  // "ASET", little endian
+
+// Blob layout: header, count entries, then the packed streams. Offsets
+// are from ASSET_ADDR.
+struct asset_hdr_s
+{
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+};
+
+struct asset_entry_s
+{
+    uint32_t offset;
+    uint16_t size;      // expanded
+    uint16_t packed;
+};
+
+// Packed streams are LZSS with a 128 byte window, which is all the stack
+// asset_print() needs besides a 16 byte read buffer. A flag byte (LSB first)
+// announces the next eight tokens: 1 is a literal byte, 0 a match of two
+// bytes, distance - 1 and length - ASSET_MIN_MATCH.
+#define ASSET_WINDOW    128
+#define ASSET_MIN_MATCH 3
+
+// Expand an asset to the UART, false if the blob doesn't have it or the
+// flash driver isn't set up yet
+bool asset_print(uint8_t id);
+
+// A banner listed above: from the blob, or printed from the firmware when
+// it's built without ASSETS_IN_FLASH
+#if ASSETS_IN_FLASH
+#define asset_banner(id, text)  asset_print(id)
+#else
+#define asset_banner(id, text)  printf(text)
+#endif
+
+#endif // __ASSET_H__
@@ -0,0 +1,24 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+// BENCH FLASH, left out by default: it erases BENCH_FLASH_ADDR and the
+// badge has no use for it outside the lab
+#ifndef FLASH_BENCH
+#define FLASH_BENCH 0
+#endif
+
+// Scratch area for the program/erase timings, gets erased! Must be 64K
+// aligned and clear of anything the challenges keep in flash.
+#ifndef BENCH_FLASH_ADDR
+#define BENCH_FLASH_ADDR 0xFF0000
+#endif
+
+#ifndef BENCH_SAMPLES
+#define BENCH_SAMPLES 16
+#endif
+
+#if FLASH_BENCH
+void benchFlash();
+#endif
+
+#endif // __BENCH_H__
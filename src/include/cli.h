@@ -9,5 +9,10 @@
 #define CMD_RESET   "RESET"
 #define CMD_REBOOT  "REBOOT"
 #define CMD_DATA    "DATA"
+#define CMD_READMODE "READMODE"
+#define CMD_STATS   "STATS"
+#define CMD_CRC     "CRC"
+#define CMD_BENCH   "BENCH"
+#define CMD_TRACE   "TRACE"
 
 #endif // __CLI_H__
@@ -16,6 +16,247 @@
 #define ERASE_CMD 0x52
 #endif
 
+// Reads of at least this many bytes are moved by DMA1 (SPI1 RX/TX channels).
+// Off by default, the polled FAST_READ loop is much smaller.
+#ifndef FLASH_USE_DMA
+#define FLASH_USE_DMA 0
+#endif
+
+#ifndef FLASH_DMA_MIN_LEN
+#define FLASH_DMA_MIN_LEN 16
+#endif
+
+// flash_read() engines, selectable at runtime with flash_set_read_mode()
+#define FLASH_READ_NORMAL	0	// 0x03, polled, one halfword at a time
+#define FLASH_READ_FAST		1	// 0x0B, polled, TX kept full
+#define FLASH_READ_DMA		2	// 0x03 through DMA1, FAST for short reads
+
+#ifndef FLASH_READ_DEFAULT
+#if FLASH_USE_DMA
+#define FLASH_READ_DEFAULT FLASH_READ_DMA
+#else
+#define FLASH_READ_DEFAULT FLASH_READ_FAST
+#endif
+#endif
+
+// Read cache: reads of up to FLASH_CACHE_MAX_READ bytes go through
+// FLASH_CACHE_LINES lines with LRU replacement, 0 lines (the default)
+// leaves it out. Each line costs FLASH_CACHE_LINE_SIZE + 12 bytes of RAM.
+#ifndef FLASH_CACHE_LINES
+#define FLASH_CACHE_LINES 0
+#endif
+
+#ifndef FLASH_CACHE_LINE_SIZE
+#define FLASH_CACHE_LINE_SIZE 32
+#endif
+
+#ifndef FLASH_CACHE_MAX_READ
+#define FLASH_CACHE_MAX_READ FLASH_CACHE_LINE_SIZE
+#endif
+
+// Read-ahead: once a few flash_read() calls in a row have each started
+// where the previous one ended, a cache miss fills the next line too, in
+// the same read command. It lives in the read cache, so it's only there
+// with FLASH_CACHE_LINES of 2 or more; 0 disables it.
+#ifndef FLASH_PREFETCH
+#define FLASH_PREFETCH 1
+#endif
+
+#if FLASH_CACHE_LINES < 2
+#undef FLASH_PREFETCH
+#define FLASH_PREFETCH 0
+#endif
+
+// Reads suspend a busy erase/program, unless it's expected to be done
+// within this many microseconds
+#ifndef FLASH_SUSPEND_BUDGET_US
+#define FLASH_SUSPEND_BUDGET_US 50
+#endif
+
+// Deep power-down after this long without a driver call (checked from
+// flash_job_poll()), 0 keeps the chip in standby
+#ifndef FLASH_PDOWN_IDLE_MS
+#define FLASH_PDOWN_IDLE_MS 1000
+#endif
+
+// Release from power-down to the first command (tRES1)
+#ifndef FLASH_TRES1_US
+#define FLASH_TRES1_US 3
+#endif
+
+// Longest wait for a program/erase before the driver gives up on the chip
+// (worst case 64K block erase is 2 s). Chip erase waits are never cut short.
+#ifndef FLASH_WAIT_TIMEOUT_MS
+#define FLASH_WAIT_TIMEOUT_MS 3000
+#endif
+
+// flash_calibrate(), a bring-up diagnostic left out by default. The
+// default SPI_CLK_PRESCALER is already the fastest clock (HCLK/2), so it can
+// only slow a board down that doesn't read back cleanly there. It keeps a
+// pattern in the sector at FLASH_CAL_ADDR.
+#ifndef FLASH_CALIBRATE
+#define FLASH_CALIBRATE 0
+#endif
+
+// The sector kept for the test pattern, and how many clean reads each SPI
+// clock step needs
+#ifndef FLASH_CAL_ADDR
+#define FLASH_CAL_ADDR 0xFE0000
+#endif
+
+#ifndef FLASH_CAL_PASSES
+#define FLASH_CAL_PASSES 4
+#endif
+
+#ifndef FLASH_JOB_SLOTS
+#define FLASH_JOB_SLOTS 4
+#endif
+
+#define FLASH_JOB_ERASE		1	// flash_erase_block()
+#define FLASH_JOB_PROGRAM	2	// page programs, buffer owned by the caller
+#define FLASH_JOB_CALL		3	// just the callback, once the chip is idle
+
+typedef void (* flash_job_cb)(void);
+
+struct flash_stats_s
+{
+    // flash_read() throughput since the last read mode change
+    uint32_t read_bytes;
+    uint32_t read_ticks;
+#if FLASH_CACHE_LINES
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+#endif
+#if FLASH_PREFETCH
+    // lines read ahead, and the ones later hit: a read command saved each
+    uint32_t prefetches;
+    uint32_t prefetch_hits;
+#endif
+    // flash_update() calls that got away without an erase / any program
+    uint32_t erases_avoided;
+    uint32_t programs_avoided;
+    // reads that hit a busy chip: suspended, or waited out because the
+    // operation was almost done / can't be suspended
+    uint32_t suspends;
+    uint32_t resumes;
+    uint32_t short_waits;
+    uint32_t forced_waits;
+    // waits that ran into their timeout, the chip looks hung
+    uint32_t wait_timeouts;
+    // deep power-down entries, and the accesses that had to wake the chip
+    uint32_t sleeps;
+    uint32_t wakes;
+    uint32_t wake_ticks;
+};
+
+extern struct flash_stats_s flash_stats;
+
+// Transaction trace: opcode, address, length, start and duration of the
+// last FLASH_TRACE_ENTRIES SPI transactions, driver and raw CLI alike.
+// Power of two, 12 bytes of RAM each. 0 compiles the tracer and the TRACE
+// command out.
+#ifndef FLASH_TRACE_ENTRIES
+#define FLASH_TRACE_ENTRIES 8
+#endif
+
+#define FLASH_TRACE_MAGIC	0x45435254	// "TRCE", little endian
+
+// Durations are SysTick ticks as a 4 bit exponent over a 12 bit mantissa,
+// rounded down: exact below 4096 ticks, within 1/4096 above, and up to
+// about 22 s (0xFFFF beyond that, a chip erase can take longer).
+#define FLASH_TRACE_DUR_BITS	12
+
+struct flash_trace_s
+{
+    uint32_t start;     // SysTick when CS went low
+    uint32_t op_addr;   // opcode << 24 | address bits 0..23
+    uint16_t len;       // data bytes, status polls for 0x05/0x70, 0xFFFF or more
+    uint16_t dur;       // until CS went high, see FLASH_TRACE_DUR_BITS
+};
+
+static inline uint32_t flash_trace_ticks(uint16_t dur)
+{
+    return (uint32_t)(dur & ((1u << FLASH_TRACE_DUR_BITS) - 1)) << (dur >> FLASH_TRACE_DUR_BITS);
+}
+
+// flash_trace_dump() output: this header, then count entries oldest first
+struct flash_trace_hdr_s
+{
+    uint32_t magic;
+    uint32_t total;     // entries recorded since boot
+    uint8_t count;
+    uint8_t size;       // sizeof(struct flash_trace_s)
+    uint8_t dur_bits;   // FLASH_TRACE_DUR_BITS
+    uint8_t ticks_us;   // SysTick ticks per microsecond
+};
+
+#if FLASH_TRACE_ENTRIES
+void flash_trace(uint8_t op, uint32_t addr, uint32_t len, uint32_t start);
+
+void flash_trace_dump();
+#else
+static inline void flash_trace(uint8_t op, uint32_t addr, uint32_t len, uint32_t start) { }
+#endif
+
+#define SFDP_SIGNATURE		0x50444653	// "SFDP", little endian
+#define SFDP_ADDR_3BYTE_ONLY	0
+#define SFDP_ADDR_3OR4BYTE	1
+#define SFDP_ADDR_4BYTE_ONLY	2
+
+// Chip geometry and opcodes, read from the SFDP Basic Flash Parameter Table
+// in flash_init() when the part has one, W25Q128 values otherwise. An
+// opcode of 0 means the operation isn't supported.
+struct flash_geom_s
+{
+    uint32_t size;
+    uint8_t erase_op[4];        // erase types, smallest first as listed
+    uint8_t erase_shift[4];     // log2 of each erase size
+    uint8_t block_op;           // flash_erase_block(): largest erase <= 32K,
+    uint8_t block_shift;        // repeated to cover the block. 0 if none
+    uint8_t read_op;            // 1-1-1 fast read
+    uint8_t read_dummy;         // dummy clocks after the address
+    uint8_t addr4;              // SFDP_ADDR_*
+    uint8_t erase_suspend;
+    uint8_t erase_resume;
+    uint8_t prog_suspend;
+    uint8_t prog_resume;
+    uint8_t sfdp;               // 1 if the values came from the chip
+};
+
+// One chip on the shared SPI1 bus. flash_init() sets up flash_dev0, more
+// chips get a handle of their own through flash_dev_init(). Every flash_*
+// call acts on the selected device (flash_dev). Busy state is per device,
+// so an erase keeps running on one chip while another one is read or
+// programmed. Only with FLASH_MULTI_DEV: otherwise flash_dev0 is the one
+// chip and flash_dev a constant that points at it.
+#ifndef FLASH_MULTI_DEV
+#define FLASH_MULTI_DEV 0
+#endif
+
+struct flash_dev_s
+{
+    int cs;
+    uint8_t flags;
+    uint8_t busy;               // program/erase in progress
+    uint8_t pdown;              // in deep power-down
+    uint8_t br;                 // SPI1 prescaler, SCK = HCLK / (2 << br)
+    uint32_t busy_start;        // SysTick at issue
+    uint32_t busy_ticks;        // expected length
+    uint32_t busy_addr;         // array range being programmed/erased
+    uint32_t busy_len;
+    uint32_t suspend_start;
+    uint32_t last_access;       // SysTick of the last driver call
+    struct flash_geom_s geom;
+    struct flash_dev_s * next;
+};
+
+extern struct flash_dev_s flash_dev0;
+#if FLASH_MULTI_DEV
+extern struct flash_dev_s * flash_dev;
+#else
+#define flash_dev (&flash_dev0)
+#endif
+
 struct _ext_cmds_s
 {
     uint8_t read;
@@ -23,22 +264,146 @@ struct _ext_cmds_s
     uint8_t erase;
 };
 
+// Opcodes flash_*_ext() send, loaded from EXT_CMDS_ADDR
+extern struct _ext_cmds_s flash_ext_cmds;
+
 uint32_t flash_capacity(const uint8_t *id);
 
  bool flash_init(int cs_pin);
 
+#if FLASH_MULTI_DEV
+// Probe the chip on cs_pin into dev, false if nothing answers. The
+// selection is left alone.
+bool flash_dev_init(struct flash_dev_s * dev, int cs_pin);
+
+// Make dev the target of the flash_* calls, returns the previous one.
+// A DMA read or stream on the old device is parked first.
+struct flash_dev_s * flash_select(struct flash_dev_s * dev);
+#endif
+
+#if FLASH_CALIBRATE
+// Find the fastest SPI clock the selected device reads back reliably on
+// this board. Steps the prescaler from HCLK/256 up, reading the JEDEC ID
+// and the pattern at FLASH_CAL_ADDR (written on first use) at each step.
+// The last step that passed is marginal if the next one failed, so that
+// case keeps one step slower. Returns the prescaler it kept.
+uint8_t flash_calibrate();
+#endif
+
+// Release the chip from deep power-down. The driver does this on its own,
+// only raw SPI users need to call it.
+void flash_wake();
+
 void flash_read(uint32_t addr, void * buf, size_t len);
 
-void flash_write(uint32_t addr, void * buf, size_t len);
+// Start a DMA read and return right away. CS stays asserted until the
+// transfer is collected with flash_read_done()/flash_read_wait(); every
+// other flash_* call waits for it first.
+void flash_read_async(uint32_t addr, void * buf, size_t len);
+
+bool flash_read_done();
+
+void flash_read_wait();
 
-void flash_erase_block(uint32_t addr);
+// Sequential reads of [addr, addr + len) in as many pieces as the caller
+// likes, without re-sending command and address for each piece.
+// flash_stream_read() returns the number of bytes read, short at the end of
+// the range. Other flash_* calls in between are fine, they just cost one
+// more command when the stream picks up again.
+void flash_stream_open(uint32_t addr, size_t len);
+
+size_t flash_stream_read(void * buf, size_t len);
+
+void flash_stream_close();
+
+// CRC-32 of [addr, addr + len), same polynomial and conventions as zlib
+uint32_t flash_crc32(uint32_t addr, uint32_t len);
+
+// Needed whenever the chip is written behind the driver's back
+void flash_cache_invalidate(uint32_t addr, uint32_t len);
+
+void flash_set_read_mode(uint8_t mode);
+
+uint8_t flash_get_read_mode();
+
+void flash_print_stats();
+
+// One status probe, true while a program/erase is still running
+bool flash_is_busy();
+
+// One status register read: 0x05, 0x35 or 0x15. Fine while the chip is busy.
+uint8_t flash_read_status(uint8_t cmd);
+
+// Runs while a wait polls the status register, with CS asserted: it must
+// not touch the SPI bus, or call back into the driver
+typedef void (* flash_yield_cb)(void);
+
+// Hook for the driver's own waits (before a program/erase, forced waits
+// in reads), NULL to just spin
+void flash_set_yield(flash_yield_cb yield);
+
+// Poll until the chip is idle, calling yield between status reads.
+// False if it is still busy after timeout_ms (0 waits forever).
+bool flash_wait_ready(uint32_t timeout_ms, flash_yield_cb yield);
+
+// False if the chip stayed busy past FLASH_WAIT_TIMEOUT_MS, the program (or
+// the rest of it) is not sent then. The same goes for the erases and the
+// _ext calls below.
+bool flash_write(uint32_t addr, void * buf, size_t len);
+
+// Erase the 32K block holding addr, nothing around it. Parts without a
+// 32K erase get as many smaller erases as it takes. False if the part only
+// erases in larger units or the chip stays busy.
+#define FLASH_BLOCK_SHIFT 15
+
+bool flash_erase_block(uint32_t addr);
+
+// Erase every sector touching [addr, addr + len) with as few commands as
+// the part allows (4K/32K/64K, or chip erase for the whole device).
+// Returns as soon as the last erase is issued.
+bool flash_erase_range(uint32_t addr, uint32_t len);
+
+// Stand-in for flash_erase_block() + flash_write(). The target is read
+// back first: identical data is left alone, data reachable by clearing
+// bits is programmed without an erase, and only otherwise the sectors
+// holding the range are erased. Returns one of FLASH_UPDATE_*.
+#define FLASH_UPDATE_SAME	0
+#define FLASH_UPDATE_PROGRAM	1
+#define FLASH_UPDATE_ERASE	2
+#define FLASH_UPDATE_FAILED	3	// the chip stayed busy, see flash_write()
+
+uint8_t flash_update(uint32_t addr, const void * buf, size_t len);
 
 void flash_read_ext(uint32_t addr, void * buf, size_t len);
 
-void flash_write_ext(uint32_t addr, void * buf, size_t len);
+bool flash_write_ext(uint32_t addr, void * buf, size_t len);
 
-void flash_erase_block_ext(uint32_t addr);
+bool flash_erase_block_ext(uint32_t addr);
 
 void flash_load_ext_cmds();
 
+// Background erase/program queue. The enqueue calls return a handle for
+// flash_job_done(), or -1 when the queue is full (or for an erase on a part
+// without a block erase). The optional callback runs as soon as its job is
+// complete. Jobs only advance in flash_job_poll(), call it from the idle
+// loop. Jobs run on the device selected when they
+// were queued, in order per device, and devices run in parallel.
+// Synchronous erase/program calls flush the device's jobs first to keep
+// program order.
+int flash_job_erase(uint32_t addr, flash_job_cb done);
+
+int flash_job_program(uint32_t addr, const void * buf, size_t len, flash_job_cb done);
+
+int flash_job_call(flash_job_cb fn);
+
+// Slots a caller can fill without waiting, 0 while a CLI BEGIN..END
+// session holds the bus (the queue can't drain then)
+uint8_t flash_job_free();
+
+bool flash_job_done(int handle);
+
+void flash_job_poll();
+
+void flash_job_flush();
+
 #endif // __FLASH_H__
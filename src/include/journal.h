@@ -0,0 +1,57 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pool.h>
+
+// Append-only record log over JOURNAL_BLOCKS erase blocks. Records carry a
+// sequence number and are appended into erased space. Blocks come from an
+// erase-ahead pool: once the log moves on to a new block the old one is
+// erased in the background (journal_poll()), so an append that starts a
+// block normally pays only for the program.
+#ifndef JOURNAL_BLOCK_SIZE
+#define JOURNAL_BLOCK_SIZE 0x8000 // flash_erase_block() granularity
+#endif
+
+#ifndef JOURNAL_BLOCKS
+#define JOURNAL_BLOCKS 2
+#endif
+
+// Blocks kept erased ahead of the log, less than JOURNAL_BLOCKS
+#ifndef JOURNAL_ERASE_AHEAD
+#define JOURNAL_ERASE_AHEAD 1
+#endif
+
+#define JOURNAL_PAYLOAD 8
+#define JOURNAL_ERASED  0xFFFFFFFF
+
+struct journal_rec_s
+{
+    uint32_t seq;
+    uint8_t data[JOURNAL_PAYLOAD];
+    uint32_t check;
+};
+
+struct journal_s
+{
+    uint32_t base;
+    uint32_t seq;   // sequence of the latest record, 0 if the log is empty
+    uint32_t last;  // address of the latest valid record
+    uint32_t next;  // address of the next free slot
+    struct pool_s pool;
+};
+
+void journal_mount(struct journal_s * j, uint32_t base);
+
+bool journal_read(struct journal_s * j, void * data);
+
+// false if there was no block to move on to or the chip stayed busy,
+// nothing is written then
+bool journal_append(struct journal_s * j, const void * data);
+
+// Background erase of retired blocks, pool_poll(): skipped while a CLI
+// session holds the bus
+void journal_poll(struct journal_s * j);
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,93 @@
+#ifndef __KV_H__
+#define __KV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pool.h>
+
+// Key-value store over KV_PAGES erase blocks, for persisted state that
+// doesn't need a fixed address. Records are appended to the newest page
+// and the newest record for a key wins. kv_mount() builds a RAM directory
+// from key hash to record address, so a get is one flash read and a put
+// one append. Pages come from an erase-ahead pool (kv_poll()). Taking the
+// last free page garbage collects the oldest one: its live records are
+// copied forward and the page goes back to the pool.
+#ifndef KV_PAGE_SIZE
+#define KV_PAGE_SIZE 0x8000 // flash_erase_block() granularity
+#endif
+
+// Two pages is the least that can collect: the live records of the older
+// one move to the newer
+#ifndef KV_PAGES
+#define KV_PAGES 2
+#endif
+
+// Most keys the store holds, power of two. Directory RAM is 8 bytes each.
+#ifndef KV_DIR_SLOTS
+#define KV_DIR_SLOTS 8
+#endif
+
+#ifndef KV_ERASE_AHEAD
+#define KV_ERASE_AHEAD 1
+#endif
+
+#define KV_KEY_MAX      16
+#define KV_VALUE_MAX    1024
+
+#define KV_PAGE_MAGIC   0x4750564B  // "KVPG", little endian
+#define KV_REC_MAGIC    0x5A
+#define KV_DELETED      0xFFFF      // vlen of a delete marker
+
+// Page layout: this header, then records back to back, each padded to 4
+// bytes. An erased record magic ends the page.
+struct kv_page_s
+{
+    uint32_t magic;
+    uint32_t seq;       // higher is newer
+};
+
+// Followed by klen key bytes (no terminator) and vlen value bytes
+struct kv_rec_s
+{
+    uint8_t magic;
+    uint8_t klen;
+    uint16_t vlen;
+    uint32_t check;     // over klen, vlen, key and value
+};
+
+struct kv_dir_s
+{
+    uint32_t addr;      // KV_DIR_EMPTY/KV_DIR_GONE, or the record
+    uint16_t hash;
+    uint16_t reserved;
+};
+
+#define KV_DIR_EMPTY    0
+#define KV_DIR_GONE     1
+
+struct kv_s
+{
+    uint32_t seq;       // sequence of the newest page
+    uint32_t page;      // newest page, appends go here
+    uint32_t next;      // next free byte in it
+    uint8_t keys;
+    struct kv_dir_s dir[KV_DIR_SLOTS];
+    struct pool_s pool;
+};
+
+void kv_mount(struct kv_s * kv, uint32_t base);
+
+// Copies up to len bytes of the value, returns its full length or -1 if
+// the key isn't there
+int kv_get(struct kv_s * kv, const char * key, void * buf, size_t len);
+
+// False if the key or value is too long, the directory is full, the live
+// records don't fit the pages any more, or the chip stayed busy
+bool kv_put(struct kv_s * kv, const char * key, const void * val, size_t len);
+
+bool kv_del(struct kv_s * kv, const char * key);
+
+void kv_poll(struct kv_s * kv);
+
+#endif // __KV_H__
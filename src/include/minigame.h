@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
+// Banners, packed into the asset blob (see asset.h)
+#define MINIGAME_BANNER \
+"=== LED Fill Minigame ===\r\n" \
+"Hold BTN_0 and release when all 6 LEDs are lit!\r\n"
+
+#define MINIGAME_TOO_LONG \
+"FAILED! Button held too long. Release when all LEDs are lit!\r\n"
+
 // Minigame function
 // Hold button and release when all LEDs are lit
 // Loops until success
@@ -0,0 +1,42 @@
+#ifndef __OTP_H__
+#define __OTP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Security registers (OTP) 1-3 at 0x1000/0x2000/0x3000, 256 bytes each,
+// behind a RAM mirror. A register is read whole the first time it's used
+// and then served from RAM. Writes and erases only touch the mirror until
+// otp_flush(): one erase if any was asked for, then one program for
+// everything written since.
+//
+// The mirror is only used while flash_ext_cmds hold the security register
+// opcodes. With anything else loaded the calls go straight to
+// flash_*_ext(), so flush before changing the opcodes.
+#define OTP_REGS        3
+#define OTP_REG_SIZE    256
+
+// Registers mirrored at once, OTP_REG_SIZE + 6 bytes of RAM each
+#ifndef OTP_MIRROR_SLOTS
+#define OTP_MIRROR_SLOTS 1
+#endif
+
+void otp_read(uint32_t addr, void * buf, size_t len);
+
+// Programs: bits only go from 1 to 0, as on the chip
+void otp_write(uint32_t addr, const void * buf, size_t len);
+
+void otp_erase(uint32_t addr);
+
+// Write out pending erases and programs. Anything pending for a locked
+// register is dropped, the chip would ignore it.
+void otp_flush();
+
+// Forget the mirror, pending writes included. For when the registers may
+// have been written behind the driver's back (raw SPI).
+void otp_invalidate();
+
+// Lock bits LB1-LB3 from status register 2, bit 0 is register 1
+uint8_t otp_locked();
+
+#endif // __OTP_H__
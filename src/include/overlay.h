@@ -0,0 +1,73 @@
+#ifndef __OVERLAY_H__
+#define __OVERLAY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <aes.h>
+#include <flash.h>
+
+// Rarely used routines built as separate images (src/overlay/*.c), kept in
+// external flash and copied into a RAM slot on demand. The slot holds one
+// overlay at a time; calling the one already loaded doesn't touch flash.
+// The packer (src/tool/pack_overlays.py) reads the OVERLAY_* list below:
+// ID, then the source file name under src/overlay.
+#define OVERLAY_STATS       0   // stats
+
+#ifndef OVERLAY_ADDR
+#define OVERLAY_ADDR 0xE10000
+#endif
+
+// Overlay images are linked to run from anywhere, but code, data and bss
+// all have to fit in here. This much RAM is gone for good, the stats
+// overlay is most of it.
+#ifndef OVERLAY_SLOT_SIZE
+#define OVERLAY_SLOT_SIZE 512
+#endif
+
+// One per image, in ID order. The table is generated into the firmware
+// (overlays.h, next to the images), not read from flash: anyone can write
+// the flash through the raw SPI commands, so an image only runs if it
+// hashes to the digest the firmware was built with. The digest is AES-128
+// Davies-Meyer over the image padded with zeros to 16 bytes, starting from
+// all zeros.
+struct overlay_entry_s
+{
+    uint32_t offset;    // from OVERLAY_ADDR
+    uint16_t size;      // multiple of 4
+    uint8_t digest[AES_BLOCKLEN];
+};
+
+// Overlays can't link against the firmware, everything they need is
+// passed in. The digests tie the images to one firmware build, so this can
+// change along with them.
+struct overlay_api_s
+{
+    int (* printf)(const char * fmt, ...);
+};
+
+// Entry point, the first thing in every image
+typedef int (* overlay_fn)(const struct overlay_api_s * api, void * arg);
+
+// Load an overlay into the slot (unless it's there already). NULL if the
+// firmware has no such image or flash doesn't hold it.
+overlay_fn overlay_load(uint8_t id);
+
+// Load and run, OVERLAY_MISSING if it can't be loaded
+#define OVERLAY_MISSING (-0x4F56)
+
+int overlay_call(uint8_t id, void * arg);
+
+// OVERLAY_STATS argument, the rest of flash_print_stats(). The caller does
+// the divisions, overlays don't get libgcc.
+struct overlay_stats_s
+{
+    const struct flash_stats_s * stats;
+    uint32_t wake_us;       // per wake
+#if FLASH_PREFETCH
+    uint32_t prefetch_pct;  // prefetched lines that were hit
+#endif
+    uint16_t clk_div;       // SPI clock is HCLK / clk_div
+};
+
+#endif // __OVERLAY_H__
@@ -0,0 +1,55 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Erase-ahead pool over count sectors of size bytes (flash_erase_block()
+// granularity) starting at base. Sectors the owner isn't using are erased
+// in the background from pool_poll(), up to ahead of them, so
+// pool_take() usually hands out a sector that only needs programming.
+//
+// Which sectors are erased is only ever known from this boot: after a
+// reset every free sector is blank checked (or erased) again before it
+// is handed out, so a sector whose erase was cut short by a power loss is
+// never taken for erased.
+#define POOL_MAX_SECTORS 32
+#define POOL_NONE 0xFF
+#define POOL_FULL 0xFFFFFFFF // pool_take() with every sector live
+
+struct pool_s
+{
+    uint32_t base;
+    uint32_t size;
+    uint8_t count;
+    uint8_t ahead;
+    uint8_t cur;        // sector being checked/erased, POOL_NONE if idle
+    uint8_t next;       // round robin start for the next pick
+    int16_t job;        // erase job for cur, -1 while blank checking
+    uint32_t checked;   // bytes of cur known to be blank
+    uint32_t live;      // bitmaps: in use by the owner
+    uint32_t ready;     // erased this boot, free
+};
+
+void pool_init(struct pool_s * p, uint32_t base, uint32_t size, uint8_t count, uint8_t ahead);
+
+// The owner found data it still needs in the sector holding addr (mount)
+void pool_claim(struct pool_s * p, uint32_t addr);
+
+// Hand out an erased sector and mark it live. With none ready yet, one is
+// erased now and the caller's first program waits for it. POOL_FULL if
+// the owner holds every sector, or if the erase it would wait for can't
+// run because a CLI session holds the bus.
+uint32_t pool_take(struct pool_s * p);
+
+// The owner is done with the sector holding addr, it may be erased
+void pool_release(struct pool_s * p, uint32_t addr);
+
+// Background work: one blank check read, or a look at the pending erase,
+// per call. Call from the idle loop next to flash_job_poll(), which is
+// what runs the erases. Does nothing while a CLI session holds the bus.
+void pool_poll(struct pool_s * p);
+
+uint8_t pool_ready(struct pool_s * p);
+
+#endif // __POOL_H__
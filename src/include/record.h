@@ -0,0 +1,46 @@
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Length-prefixed records in flash, each read with one read command:
+// header, payload and whatever follows come from a single stream.
+//
+// Legacy layout, as the challenge stages store it: a size_t length, then
+// the payload. Nothing is validated beyond clamping the length to the
+// caller's buffer, so the layout stays exactly what's on the badges.
+//
+// Typed layout, for new records: a struct record_hdr_s, then len payload
+// bytes. The check covers type, length and payload, so a record that was
+// never written, torn, or of another type reads as missing. Type 0xFFFF is
+// erased flash.
+#ifndef RECORD_PAYLOAD_MAX
+#define RECORD_PAYLOAD_MAX 32 // record_put() builds the record on the stack
+#endif
+
+// Record types
+#define RECORD_READ_MODE    1   // uint8_t, flash_set_read_mode()
+
+struct record_hdr_s
+{
+    uint16_t type;
+    uint16_t len;
+    uint32_t check;
+};
+
+// Reads the length at addr, then up to max payload bytes, then tail_len
+// bytes that follow the stored (clamped) payload. Returns the clamped
+// length. tail may be NULL.
+size_t record_read(uint32_t addr, void * buf, size_t max, void * tail, size_t tail_len);
+
+// Returns the payload length, or -1 if there is no valid record of this
+// type at addr or it doesn't fit in max
+int record_get(uint32_t addr, uint16_t type, void * buf, size_t max);
+
+// Writes with flash_update(), false if len is over RECORD_PAYLOAD_MAX or
+// the chip stayed busy
+bool record_put(uint32_t addr, uint16_t type, const void * buf, size_t len);
+
+#endif // __RECORD_H__
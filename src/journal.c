@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <flash.h>
+#include <journal.h>
+
+#define JOURNAL_REC_SIZE sizeof(struct journal_rec_s)
+#define JOURNAL_SLOTS    (JOURNAL_BLOCK_SIZE / JOURNAL_REC_SIZE)
+
+static uint32_t journal_check(const struct journal_rec_s * r)
+{
+    uint32_t sum = r->seq;
+
+    for (unsigned i = 0; i < JOURNAL_PAYLOAD; i += 4)
+    {
+        uint32_t w;
+
+        memcpy(&w, r->data + i, sizeof(w));
+        sum += w;
+    }
+
+    return ~sum;
+}
+
+static uint32_t journal_seq(uint32_t addr)
+{
+    uint32_t seq;
+
+    flash_read(addr, &seq, sizeof(seq));
+
+    return seq;
+}
+
+static bool journal_valid(uint32_t addr, struct journal_rec_s * r)
+{
+    flash_read(addr, r, JOURNAL_REC_SIZE);
+
+    return (r->seq != JOURNAL_ERASED) && (r->check == journal_check(r));
+}
+
+void journal_mount(struct journal_s * j, uint32_t base)
+{
+    struct journal_rec_s r;
+    uint32_t block = 0, lo, hi, mid;
+    uint32_t i;
+
+    j->base = base;
+    j->seq = 0;
+    j->last = JOURNAL_ERASED;
+    j->next = base;
+    pool_init(&j->pool, base, JOURNAL_BLOCK_SIZE, JOURNAL_BLOCKS, JOURNAL_ERASE_AHEAD);
+
+    // The block whose first record is newest holds the head of the log
+    for (i = 0; i < JOURNAL_BLOCKS; i++)
+    {
+        uint32_t addr = base + i * JOURNAL_BLOCK_SIZE;
+
+        if (journal_valid(addr, &r) && (j->last == JOURNAL_ERASED || r.seq > j->seq))
+        {
+            j->seq = r.seq;
+            j->last = addr;
+            block = addr;
+        }
+    }
+
+    if (j->last == JOURNAL_ERASED)
+    {
+        return;
+    }
+
+    // Every other block only holds older records, the pool may erase them
+    pool_claim(&j->pool, block);
+
+    // Records fill a block front to back, find the first erased slot
+    lo = 1;
+    hi = JOURNAL_SLOTS;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+
+        if (journal_seq(block + mid * JOURNAL_REC_SIZE) == JOURNAL_ERASED)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    j->next = block + lo * JOURNAL_REC_SIZE;
+
+    // Skip back over a record torn by a power loss
+    for (i = lo; i > 0; i--)
+    {
+        uint32_t addr = block + (i - 1) * JOURNAL_REC_SIZE;
+
+        if (journal_valid(addr, &r))
+        {
+            j->seq = r.seq;
+            j->last = addr;
+
+            break;
+        }
+    }
+}
+
+bool journal_read(struct journal_s * j, void * data)
+{
+    struct journal_rec_s r;
+
+    if (j->last == JOURNAL_ERASED)
+    {
+        return false;
+    }
+
+    flash_read(j->last, &r, JOURNAL_REC_SIZE);
+    memcpy(data, r.data, JOURNAL_PAYLOAD);
+
+    return true;
+}
+
+bool journal_append(struct journal_s * j, const void * data)
+{
+    struct journal_rec_s r;
+    uint32_t old = JOURNAL_ERASED;
+    uint32_t block;
+    bool fresh = false;
+
+    // Current block is full (or the log is empty): move to an erased one
+    if (j->last == JOURNAL_ERASED || (j->next % JOURNAL_BLOCK_SIZE) == 0)
+    {
+        block = pool_take(&j->pool);
+
+        if (block == POOL_FULL)
+        {
+            return false;
+        }
+
+        old = j->last;
+        j->next = block;
+        fresh = true;
+    }
+
+    r.seq = j->seq + 1;
+    memcpy(r.data, data, JOURNAL_PAYLOAD);
+    r.check = journal_check(&r);
+
+    if (!flash_write(j->next, &r, JOURNAL_REC_SIZE))
+    {
+        // Nothing was programmed, the next append takes a block again
+        if (fresh)
+        {
+            pool_release(&j->pool, block);
+        }
+
+        return false;
+    }
+
+    // Only now that the new block has the newest record, so a power loss
+    // in between still mounts the old one
+    if (old != JOURNAL_ERASED)
+    {
+        pool_release(&j->pool, old);
+    }
+
+    j->seq = r.seq;
+    j->last = j->next;
+    j->next += JOURNAL_REC_SIZE;
+
+    return true;
+}
+
+void journal_poll(struct journal_s * j)
+{
+    pool_poll(&j->pool);
+}
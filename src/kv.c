@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <flash.h>
+#include <kv.h>
+
+#define KV_REC_SIZE sizeof(struct kv_rec_s)
+#define KV_CHUNK    32
+#define KV_NONE     0xFFFFFFFF
+
+// No multiplier on the core, shifts and adds only
+static uint32_t kv_sum(uint32_t sum, const uint8_t * p, size_t n)
+{
+    while (n--)
+    {
+        sum = (sum << 5) + sum + *p++;
+    }
+
+    return sum;
+}
+
+static uint16_t kv_hash(const char * key, uint8_t klen)
+{
+    uint32_t h = kv_sum(5381, (const uint8_t *)key, klen);
+
+    return h ^ (h >> 16);
+}
+
+static uint32_t kv_size(const struct kv_rec_s * r)
+{
+    uint32_t n = KV_REC_SIZE + r->klen + ((r->vlen == KV_DELETED) ? 0 : r->vlen);
+
+    return (n + 3) & ~3u;
+}
+
+static uint32_t kv_page_seq(uint32_t page)
+{
+    struct kv_page_s h;
+
+    flash_read(page, &h, sizeof(h));
+
+    return (h.magic == KV_PAGE_MAGIC) ? h.seq : KV_NONE;
+}
+
+// The record at addr, with its key in k. False if it is torn or garbage.
+static bool kv_rec_read(uint32_t addr, struct kv_rec_s * r, char * k)
+{
+    uint8_t chunk[KV_CHUNK];
+    uint32_t sum, n, left;
+
+    flash_read(addr, r, KV_REC_SIZE);
+
+    if (r->magic != KV_REC_MAGIC || r->klen == 0 || r->klen > KV_KEY_MAX ||
+        (r->vlen != KV_DELETED && r->vlen > KV_VALUE_MAX))
+    {
+        return false;
+    }
+
+    flash_stream_open(addr + KV_REC_SIZE, r->klen + ((r->vlen == KV_DELETED) ? 0 : r->vlen));
+    flash_stream_read(k, r->klen);
+    sum = kv_sum(((uint32_t)r->klen << 16) | r->vlen, (const uint8_t *)k, r->klen);
+
+    for (left = (r->vlen == KV_DELETED) ? 0 : r->vlen; left; left -= n)
+    {
+        n = (left < sizeof(chunk)) ? left : sizeof(chunk);
+        flash_stream_read(chunk, n);
+        sum = kv_sum(sum, chunk, n);
+    }
+
+    flash_stream_close();
+
+    return r->check == ~sum;
+}
+
+// Directory slot holding key, or the slot to put it in (found clear).
+// -1 when it isn't there and the directory is full.
+static int kv_find(struct kv_s * kv, const char * key, uint8_t klen, uint16_t hash, bool * found)
+{
+    struct kv_rec_s r;
+    char k[KV_KEY_MAX];
+    int gone = -1;
+
+    *found = false;
+
+    for (unsigned i = 0; i < KV_DIR_SLOTS; i++)
+    {
+        unsigned s = (hash + i) & (KV_DIR_SLOTS - 1);
+        struct kv_dir_s * e = &kv->dir[s];
+
+        if (e->addr == KV_DIR_EMPTY)
+        {
+            return (gone >= 0) ? gone : (int)s;
+        }
+
+        if (e->addr == KV_DIR_GONE)
+        {
+            if (gone < 0)
+            {
+                gone = s;
+            }
+
+            continue;
+        }
+
+        if (e->hash != hash)
+        {
+            continue;
+        }
+
+        // Header and key are small enough for the read cache
+        flash_read(e->addr, &r, KV_REC_SIZE);
+        flash_read(e->addr + KV_REC_SIZE, k, klen);
+
+        if (r.klen == klen && !memcmp(k, key, klen))
+        {
+            *found = true;
+
+            return s;
+        }
+    }
+
+    return gone;
+}
+
+static void kv_apply(struct kv_s * kv, uint32_t addr, const struct kv_rec_s * r, const char * k)
+{
+    uint16_t hash = kv_hash(k, r->klen);
+    bool found;
+    int s = kv_find(kv, k, r->klen, hash, &found);
+
+    if (r->vlen == KV_DELETED)
+    {
+        if (found)
+        {
+            kv->dir[s].addr = KV_DIR_GONE;
+            kv->keys--;
+        }
+    }
+    else if (s >= 0)
+    {
+        kv->keys += !found;
+        kv->dir[s].addr = addr;
+        kv->dir[s].hash = hash;
+    }
+}
+
+// Replays one page into the directory, returns where its records end.
+// A torn record closes the page: nothing more is appended after it.
+static uint32_t kv_scan(struct kv_s * kv, uint32_t page)
+{
+    struct kv_rec_s r;
+    char k[KV_KEY_MAX];
+    uint32_t addr = page + sizeof(struct kv_page_s);
+    uint32_t end = page + KV_PAGE_SIZE;
+
+    while (addr + KV_REC_SIZE <= end)
+    {
+        if (!kv_rec_read(addr, &r, k))
+        {
+            return (r.magic == 0xFF) ? addr : end;
+        }
+
+        kv_apply(kv, addr, &r, k);
+        addr += kv_size(&r);
+    }
+
+    return end;
+}
+
+static void kv_gc(struct kv_s * kv);
+
+void kv_mount(struct kv_s * kv, uint32_t base)
+{
+    uint32_t seq, last = 0, page, best, bseq = 0;
+    bool first = true;
+
+    memset(kv, 0, sizeof(*kv));
+    kv->page = KV_NONE;
+    pool_init(&kv->pool, base, KV_PAGE_SIZE, KV_PAGES, KV_ERASE_AHEAD);
+
+    // Oldest page first, so newer records win
+    while (1)
+    {
+        best = KV_NONE;
+
+        for (uint8_t i = 0; i < KV_PAGES; i++)
+        {
+            page = base + i * KV_PAGE_SIZE;
+            seq = kv_page_seq(page);
+
+            if (seq != KV_NONE && (first || seq > last) && (best == KV_NONE || seq < bseq))
+            {
+                best = page;
+                bseq = seq;
+            }
+        }
+
+        if (best == KV_NONE)
+        {
+            break;
+        }
+
+        pool_claim(&kv->pool, best);
+        kv->page = best;
+        kv->next = kv_scan(kv, best);
+        last = bseq;
+        first = false;
+    }
+
+    kv->seq = last;
+
+    // Collected pages keep their header until the pool erases them, and a
+    // reset can land between taking the last free page and collecting.
+    // Either way every page is claimed now: collect, so there's a page to
+    // move on to.
+    if (kv->page != KV_NONE && kv->pool.live == (1ul << kv->pool.count) - 1)
+    {
+        kv_gc(kv);
+    }
+}
+
+int kv_get(struct kv_s * kv, const char * key, void * buf, size_t len)
+{
+    struct kv_rec_s r;
+    char k[KV_KEY_MAX];
+    size_t klen = strlen(key);
+    uint16_t hash = kv_hash(key, klen);
+
+    if (klen > KV_KEY_MAX)
+    {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < KV_DIR_SLOTS; i++)
+    {
+        struct kv_dir_s * e = &kv->dir[(hash + i) & (KV_DIR_SLOTS - 1)];
+
+        if (e->addr == KV_DIR_EMPTY)
+        {
+            break;
+        }
+
+        if (e->addr == KV_DIR_GONE || e->hash != hash)
+        {
+            continue;
+        }
+
+        // Header, key and value in one read command
+        flash_stream_open(e->addr, KV_REC_SIZE + klen + len);
+        flash_stream_read(&r, KV_REC_SIZE);
+        flash_stream_read(k, klen);
+
+        if (r.klen == klen && !memcmp(k, key, klen))
+        {
+            flash_stream_read(buf, (len < r.vlen) ? len : r.vlen);
+            flash_stream_close();
+
+            return r.vlen;
+        }
+
+        flash_stream_close();
+    }
+
+    return -1;
+}
+
+static bool kv_room(struct kv_s * kv, uint32_t size)
+{
+    return kv->page != KV_NONE && kv->next + size <= kv->page + KV_PAGE_SIZE;
+}
+
+// A program failed part way: mount stops at the torn record, so nothing
+// more may go after it
+static void kv_close(struct kv_s * kv)
+{
+    kv->next = kv->page + KV_PAGE_SIZE;
+}
+
+// Copy one record to the end of the newest page, in cache sized pieces
+static bool kv_copy(struct kv_s * kv, uint32_t addr, uint32_t size)
+{
+    uint8_t chunk[KV_CHUNK];
+    uint32_t n;
+
+    for (uint32_t off = 0; off < size; off += n)
+    {
+        n = (size - off < sizeof(chunk)) ? size - off : sizeof(chunk);
+        flash_read(addr + off, chunk, n);
+
+        if (!flash_write(kv->next + off, chunk, n))
+        {
+            kv_close(kv);
+
+            return false;
+        }
+    }
+
+    kv->next += size;
+
+    return true;
+}
+
+// Move the live records off the oldest page and hand it back to the pool
+static void kv_gc(struct kv_s * kv)
+{
+    struct kv_rec_s r;
+    char k[KV_KEY_MAX];
+    uint32_t oldest = KV_NONE, min = KV_NONE, seq, page, addr, end, size;
+    bool found;
+    int s;
+
+    for (uint8_t i = 0; i < KV_PAGES; i++)
+    {
+        page = kv->pool.base + i * KV_PAGE_SIZE;
+        seq = kv_page_seq(page);
+
+        if (page != kv->page && (kv->pool.live & (1ul << i)) && seq != KV_NONE &&
+            (min == KV_NONE || seq < min))
+        {
+            oldest = page;
+            min = seq;
+        }
+    }
+
+    if (oldest == KV_NONE)
+    {
+        return;
+    }
+
+    end = oldest + KV_PAGE_SIZE;
+
+    for (addr = oldest + sizeof(struct kv_page_s); addr + KV_REC_SIZE <= end; addr += size)
+    {
+        if (!kv_rec_read(addr, &r, k))
+        {
+            break;
+        }
+
+        size = kv_size(&r);
+        s = kv_find(kv, k, r.klen, kv_hash(k, r.klen), &found);
+
+        // Delete markers and overwritten values stay behind
+        if (found && kv->dir[s].addr == addr)
+        {
+            if (!kv_room(kv, size))
+            {
+                // Live data fills the pages, keep it where it is
+                return;
+            }
+
+            if (!kv_copy(kv, addr, size))
+            {
+                // The old page still has the good copy
+                return;
+            }
+
+            kv->dir[s].addr = kv->next - size;
+        }
+    }
+
+    pool_release(&kv->pool, oldest);
+}
+
+static void kv_new_page(struct kv_s * kv)
+{
+    struct kv_page_s h = { KV_PAGE_MAGIC, kv->seq + 1 };
+    uint32_t page = pool_take(&kv->pool);
+
+    if (page == POOL_FULL)
+    {
+        // The current page stays the newest, appends that don't fit fail
+        return;
+    }
+
+    if (!flash_write(page, &h, sizeof(h)))
+    {
+        // No header, so it's not a page yet: free again
+        pool_release(&kv->pool, page);
+
+        return;
+    }
+
+    kv->page = page;
+    kv->seq = h.seq;
+    kv->next = kv->page + sizeof(h);
+
+    // That was the last free page: collect now, while there's one to
+    // collect into
+    if (kv->pool.live == (1ul << kv->pool.count) - 1)
+    {
+        kv_gc(kv);
+    }
+}
+
+// Returns where the record went, 0 if it doesn't fit
+static uint32_t kv_append(struct kv_s * kv, const char * key, uint8_t klen, const void * val, uint16_t vlen)
+{
+    uint8_t head[KV_REC_SIZE + KV_KEY_MAX];
+    struct kv_rec_s r = { KV_REC_MAGIC, klen, vlen, 0 };
+    uint32_t sum, addr, size = kv_size(&r);
+
+    if (!kv_room(kv, size))
+    {
+        kv_new_page(kv);
+
+        if (!kv_room(kv, size))
+        {
+            return 0;
+        }
+    }
+
+    sum = kv_sum(((uint32_t)klen << 16) | vlen, (const uint8_t *)key, klen);
+
+    if (vlen != KV_DELETED)
+    {
+        sum = kv_sum(sum, val, vlen);
+    }
+
+    r.check = ~sum;
+    addr = kv->next;
+
+    // Header and key first: a record torn after them fails its check and
+    // closes the page, it can't be mistaken for free space
+    memcpy(head, &r, KV_REC_SIZE);
+    memcpy(head + KV_REC_SIZE, key, klen);
+
+    if (!flash_write(addr, head, KV_REC_SIZE + klen) ||
+        (vlen && vlen != KV_DELETED && !flash_write(addr + KV_REC_SIZE + klen, (void *)val, vlen)))
+    {
+        kv_close(kv);
+
+        return 0;
+    }
+
+    kv->next += size;
+
+    return addr;
+}
+
+bool kv_put(struct kv_s * kv, const char * key, const void * val, size_t len)
+{
+    size_t klen = strlen(key);
+    uint16_t hash;
+    uint32_t addr;
+    bool found;
+    int s;
+
+    if (!klen || klen > KV_KEY_MAX || len > KV_VALUE_MAX)
+    {
+        return false;
+    }
+
+    hash = kv_hash(key, klen);
+    s = kv_find(kv, key, klen, hash, &found);
+
+    // A collection during the append moves records, never directory slots
+    if (s < 0 || !(addr = kv_append(kv, key, klen, val, len)))
+    {
+        return false;
+    }
+
+    kv->keys += !found;
+    kv->dir[s].addr = addr;
+    kv->dir[s].hash = hash;
+
+    return true;
+}
+
+bool kv_del(struct kv_s * kv, const char * key)
+{
+    size_t klen = strlen(key);
+    bool found;
+    int s;
+
+    if (!klen || klen > KV_KEY_MAX)
+    {
+        return false;
+    }
+
+    s = kv_find(kv, key, klen, kv_hash(key, klen), &found);
+
+    if (!found || !kv_append(kv, key, klen, NULL, KV_DELETED))
+    {
+        return false;
+    }
+
+    kv->dir[s].addr = KV_DIR_GONE;
+    kv->keys--;
+
+    return true;
+}
+
+void kv_poll(struct kv_s * kv)
+{
+    pool_poll(&kv->pool);
+}
@@ -8,6 +8,11 @@
 #include <keys.h>
 #include <uart.h>
 #include <flash.h>
+#include <journal.h>
+#include <record.h>
+#include <otp.h>
+#include <bench.h>
+#include <asset.h>
 #include <cli.h>
 #include <led.h>
 #include <button.h>
@@ -26,6 +31,7 @@
 #define PIN_FLASH_CS PC3
 
 #define CHALLENGE_STATUS_ADDR 0x900000
+#define SETTINGS_ADDR 0xFD0000 // typed records, see record.h
 #define RESET_MAX_JIFFIES 1000000
 
 uint32_t initial_jiffies = 0;
@@ -36,6 +42,24 @@ struct challenge_status_s
     uint32_t count;
 } status;
 
+// Status records are appended to a log instead of erase+rewrite in place
+static struct journal_s status_log;
+_Static_assert(sizeof(struct challenge_status_s) == JOURNAL_PAYLOAD, "status must fill a journal record");
+
+#if FLASH_TRACE_ENTRIES
+// Raw SPI transaction from ASSERT to RELEASE, recorded in the flash trace.
+// The first byte clocked out is the opcode, the next three the address.
+struct raw_spi_s
+{
+    uint32_t start;
+    uint32_t addr;
+    uint16_t count;
+    uint8_t op;
+};
+
+static struct raw_spi_s raw_spi;
+#endif
+
 void init_pins(void)
 {
     // Initialize LEDs
@@ -48,7 +72,11 @@ void init_pins(void)
 
 void handleChallengeStatus()
 {
-    flash_read(CHALLENGE_STATUS_ADDR, &status, sizeof(struct challenge_status_s));
+    if (!journal_read(&status_log, &status))
+    {
+        status.jiffies = 0xffffffff;
+        status.count = 0xffffffff;
+    }
 
     // First time!
     if ((status.jiffies == 0xffffffff) && (status.count == 0xffffffff))
@@ -65,18 +93,21 @@ void handleChallengeStatus()
 
     status.jiffies = SysTick->CNT - initial_jiffies;
 
-    flash_erase_block(CHALLENGE_STATUS_ADDR);
-    flash_write(CHALLENGE_STATUS_ADDR, &status, sizeof(struct challenge_status_s));
+    journal_append(&status_log, &status);
 }
 
 void resetChallengeStatus()
 {
-    flash_erase_block(CHALLENGE_STATUS_ADDR);
+    // An all-ones record reads back just like the erased block used to
+    struct challenge_status_s blank = { 0xffffffff, 0xffffffff };
+
+    journal_append(&status_log, &blank);
 }
 
 int setup()
 {
     int err = -1;
+    uint8_t mode;
     
     initial_jiffies = SysTick->CNT;
 
@@ -87,7 +118,20 @@ int setup()
 
         blink_finger(PIN_HAND_LED,2);
 
+#if FLASH_CALIBRATE
+        // Diagnostic: drop to a clock this board reads back cleanly
+        flash_calibrate();
+#endif
+
         flash_load_ext_cmds();
+
+        // READMODE from an earlier boot
+        if (record_get(SETTINGS_ADDR, RECORD_READ_MODE, &mode, sizeof(mode)) == sizeof(mode))
+        {
+            flash_set_read_mode(mode);
+        }
+
+        journal_mount(&status_log, CHALLENGE_STATUS_ADDR);
     }
     else
     {
@@ -116,6 +160,7 @@ int setup()
 
         printf("Resetting quest...\r\n");
         setupQuest();
+        flash_job_flush();
 
         printf("Done.\r\n");
 
@@ -131,7 +176,15 @@ int setup()
     plunderLoad();
 #endif
 
+#if ASSETS_IN_FLASH
+    if (!asset_print(ASSET_INTRO))
+    {
+        printf("Intro missing, write the blob with src/tool/pack_assets.py\r\n");
+    }
+    printf("\r\n");
+#else
     printf(INTRO_MESSAGE "\r\n");
+#endif
 #endif
 
     err = 0;
@@ -280,15 +333,38 @@ static void parseCmd(char * data, size_t len)
     }
     if (!strcmp(CMD_ASSERT, data))
     {
+#if FLASH_TRACE_ENTRIES
+        raw_spi.start = SysTick->CNT;
+        raw_spi.addr = 0;
+        raw_spi.count = 0;
+#endif
         funDigitalWrite(PIN_FLASH_CS, FUN_LOW)
     }
     else if (!strcmp(CMD_RELEASE, data))
     {
+        // Raw SPI may have rewritten anything, drop the cached lines
+        flash_cache_invalidate(0, 0xFFFFFFFF);
+#ifdef GOLD_CHALLENGE
+        otp_invalidate();
+#endif
         funDigitalWrite(PIN_FLASH_CS, FUN_HIGH)
+
+#if FLASH_TRACE_ENTRIES
+        if (raw_spi.count)
+        {
+            flash_trace(raw_spi.op, raw_spi.addr, (raw_spi.count > 4) ? raw_spi.count - 4 : 0, raw_spi.start);
+            raw_spi.count = 0;
+        }
+#endif
     }
     else if (!strcmp(CMD_BEGIN, data))
     {
+        flash_cache_invalidate(0, 0xFFFFFFFF);
+#ifdef GOLD_CHALLENGE
+        otp_invalidate();
+#endif
         SPI_init();
+        flash_wake();
         SPI_begin_8();
     }
     else if (!strcmp(CMD_END, data))
@@ -297,9 +373,107 @@ static void parseCmd(char * data, size_t len)
     }
     else if (!strcmp(CMD_RESET, data))
     {
-        resetChallengeStatus();
-        setupQuest();
+        // The stages are written in the background, check before the
+        // status is touched
+        if (!setupQuestReady())
+        {
+            printf("Flash busy, RESET again later\r\n");
+        }
+        else
+        {
+            resetChallengeStatus();
+
+            if (setupQuest() < 0)
+            {
+                printf("Flash busy, RESET again later\r\n");
+            }
+        }
+    }
+    else if (!memcmp(CMD_READMODE, data, sizeof(CMD_READMODE) - 1))
+    {
+        // READMODE <0|1|2>, resets the throughput counters and is kept
+        // across reboots
+        if (len > sizeof(CMD_READMODE))
+        {
+            uint8_t mode = xtoi(data[sizeof(CMD_READMODE)]);
+
+            flash_set_read_mode(mode);
+
+            if (flash_get_read_mode() == mode &&
+                !record_put(SETTINGS_ADDR, RECORD_READ_MODE, &mode, sizeof(mode)))
+            {
+                printf("Read mode not saved, flash busy\r\n");
+            }
+        }
+
+        flash_print_stats();
     }
+    else if (!strcmp(CMD_STATS, data))
+    {
+        flash_print_stats();
+    }
+    else if (!memcmp(CMD_CRC, data, sizeof(CMD_CRC) - 1) &&
+             (data[sizeof(CMD_CRC) - 1] == ' ' || data[sizeof(CMD_CRC) - 1] == '\0'))
+    {
+        // CRC [<addr> [<len>]], hex, defaults run to the end of the chip
+        uint32_t addr = 0, size = flash_dev->geom.size;
+
+        if (len > sizeof(CMD_CRC))
+        {
+            i = sizeof(CMD_CRC);
+            addr = atox(&data[i]);
+
+            while (xtoi(data[i]) != 0xff)
+            {
+                i++;
+            }
+
+            while (i < len && xtoi(data[i]) == 0xff)
+            {
+                i++;
+            }
+
+            size = (i < len) ? atox(&data[i]) : flash_dev->geom.size - addr;
+        }
+
+        if (addr >= flash_dev->geom.size)
+        {
+            printf("Address past the end of the chip (%08lx)\r\n", flash_dev->geom.size);
+        }
+        else
+        {
+            // stop at the end of the chip
+            if (size > flash_dev->geom.size - addr)
+            {
+                size = flash_dev->geom.size - addr;
+            }
+
+            printf("CRC32 %08lx\r\n", flash_crc32(addr, size));
+        }
+    }
+#if FLASH_BENCH
+    else if (!memcmp(CMD_BENCH, data, sizeof(CMD_BENCH) - 1))
+    {
+        // BENCH FLASH, erases BENCH_FLASH_ADDR. The argument has to be
+        // there, past the NUL is whatever the last command left.
+        if (len > sizeof(CMD_BENCH) && data[sizeof(CMD_BENCH) - 1] == ' ' &&
+            !strcmp("FLASH", data + sizeof(CMD_BENCH)))
+        {
+            benchFlash();
+        }
+        else
+        {
+            printf("Usage: " CMD_BENCH " FLASH\r\n");
+        }
+    }
+#endif
+#if FLASH_TRACE_ENTRIES
+    else if (!strcmp(CMD_TRACE, data))
+    {
+        // Binary, see struct flash_trace_hdr_s and src/tool/trace.py
+        flash_trace_dump();
+    }
+#endif
     else if (!memcmp(CMD_DATA, data, 4))
     {
         if (len <= sizeof(CMD_DATA) - 1)
@@ -322,6 +496,19 @@ static void parseCmd(char * data, size_t len)
 
             uint8_t out = SPI_transfer_8(in);
 
+#if FLASH_TRACE_ENTRIES
+            if (raw_spi.count == 0)
+            {
+                raw_spi.op = in;
+            }
+            else if (raw_spi.count < 4)
+            {
+                raw_spi.addr = (raw_spi.addr << 8) | in;
+            }
+
+            raw_spi.count++;
+#endif
+
             printf("%02x ", out);
 
             // Find the next non-number, which follows a number
@@ -351,6 +538,13 @@ static void handleSerialRead()
 
     while (len < sizeof(data) - 1)
     {
+        // Let queued flash work and erase-ahead advance while waiting for input
+        while (!uartAvailable())
+        {
+            flash_job_poll();
+            journal_poll(&status_log);
+        }
+
         data[len++] = _gets();
 
         if ((data[len - 1] == '\r') || (data[len - 1] == '\n'))
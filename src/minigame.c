@@ -3,6 +3,7 @@
 #include "include/minigame.h"
 #include "include/button.h"
 #include "include/led.h"
+#include "include/asset.h"
 
 // Minigame: Hold button and release when all 5 LEDs are lit
 // Loops until success
@@ -23,8 +24,7 @@ int led_fill_minigame(int fill_rate_ms)
         PIN_HAND_LED
     };
     
-    printf("=== LED Fill Minigame ===\r\n");
-    printf("Hold BTN_0 and release when all 6 LEDs are lit!\r\n");
+    asset_banner(ASSET_MINIGAME, MINIGAME_BANNER);
     
     // Loop until success
     while (1)
@@ -126,7 +126,7 @@ int led_fill_minigame(int fill_rate_ms)
             else
             {
                 // Button still held - failure
-                printf("FAILED! Button held too long. Release when all LEDs are lit!\r\n");
+                asset_banner(ASSET_TOO_LONG, MINIGAME_TOO_LONG);
                 button_released = 0; // Mark as failure (button still held)
                 // turn off all LEDs from 5 to 0
                 for (int i = 5; i >= 0; i--)
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <flash.h>
+#include <otp.h>
+
+#define OTP_CMD_READ    0x48
+#define OTP_CMD_WRITE   0x42
+#define OTP_CMD_ERASE   0x44
+#define OTP_SR2_LB_SHIFT 3  // LB1-LB3 are bits 3-5
+
+struct otp_slot_s
+{
+    uint8_t reg;        // 1-3, 0 if the slot is empty
+    uint8_t erase;      // erase before programming
+    uint16_t lo, hi;    // [lo, hi) to program
+    uint8_t data[OTP_REG_SIZE];
+};
+
+static struct otp_slot_s otp_slots[OTP_MIRROR_SLOTS];
+static uint8_t otp_victim;
+
+static bool otp_cached()
+{
+    return flash_ext_cmds.read == OTP_CMD_READ &&
+        flash_ext_cmds.write == OTP_CMD_WRITE &&
+        flash_ext_cmds.erase == OTP_CMD_ERASE;
+}
+
+// Register holding addr, 0 if addr isn't in one
+static uint8_t otp_reg(uint32_t addr)
+{
+    return ((addr & ~0x3000ul) < OTP_REG_SIZE) ? (addr >> 12) & 3 : 0;
+}
+
+static uint32_t otp_base(uint8_t reg)
+{
+    return (uint32_t)reg << 12;
+}
+
+static void otp_flush_slot(struct otp_slot_s * s)
+{
+    if (!s->reg || (!s->erase && s->lo >= s->hi))
+    {
+        return;
+    }
+
+    if ((otp_locked() & (1 << (s->reg - 1))) ||
+        (s->erase && !flash_erase_block_ext(otp_base(s->reg))) ||
+        (s->lo < s->hi && !flash_write_ext(otp_base(s->reg) + s->lo, s->data + s->lo, s->hi - s->lo)))
+    {
+        // Locked, or the chip stayed busy: the mirror has what was asked
+        // for, not what the chip kept
+        s->reg = 0;
+    }
+
+    s->erase = 0;
+    s->lo = OTP_REG_SIZE;
+    s->hi = 0;
+}
+
+// Mirror of reg, read from the chip unless the caller overwrites it all
+static struct otp_slot_s * otp_slot(uint8_t reg, bool fill)
+{
+    struct otp_slot_s * s;
+
+    for (uint8_t i = 0; i < OTP_MIRROR_SLOTS; i++)
+    {
+        if (otp_slots[i].reg == reg)
+        {
+            return &otp_slots[i];
+        }
+    }
+
+    s = &otp_slots[otp_victim];
+    otp_victim = (otp_victim + 1) % OTP_MIRROR_SLOTS;
+    otp_flush_slot(s);
+
+    s->reg = reg;
+    s->erase = 0;
+    s->lo = OTP_REG_SIZE;
+    s->hi = 0;
+
+    if (fill)
+    {
+        flash_read_ext(otp_base(reg), s->data, OTP_REG_SIZE);
+    }
+
+    return s;
+}
+
+void otp_read(uint32_t addr, void * buf, size_t len)
+{
+    uint8_t * p = (uint8_t *)buf;
+    uint8_t reg = otp_reg(addr);
+    struct otp_slot_s * s;
+    size_t n;
+
+    if (!reg || !otp_cached())
+    {
+        flash_read_ext(addr, buf, len);
+
+        return;
+    }
+
+    s = otp_slot(reg, true);
+    n = (len < OTP_REG_SIZE) ? len : OTP_REG_SIZE;
+
+    // Wraps within the register like the chip, zeroes past 256 bytes like
+    // flash_read_ext()
+    for (size_t i = 0; i < n; i++)
+    {
+        p[i] = s->data[(addr + i) & (OTP_REG_SIZE - 1)];
+    }
+
+    memset(p + n, 0, len - n);
+}
+
+void otp_write(uint32_t addr, const void * buf, size_t len)
+{
+    const uint8_t * p = (const uint8_t *)buf;
+    uint8_t reg = otp_reg(addr);
+    struct otp_slot_s * s;
+    uint16_t off;
+
+    if (!reg || !otp_cached())
+    {
+        flash_write_ext(addr, (void *)buf, len);
+
+        return;
+    }
+
+    s = otp_slot(reg, true);
+    len = (len < OTP_REG_SIZE) ? len : OTP_REG_SIZE;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        off = (addr + i) & (OTP_REG_SIZE - 1);
+        s->data[off] &= p[i];
+        s->lo = (off < s->lo) ? off : s->lo;
+        s->hi = (off + 1 > s->hi) ? off + 1 : s->hi;
+    }
+}
+
+void otp_erase(uint32_t addr)
+{
+    uint8_t reg = otp_reg(addr);
+    struct otp_slot_s * s;
+
+    if (!reg || !otp_cached())
+    {
+        flash_erase_block_ext(addr);
+
+        return;
+    }
+
+    s = otp_slot(reg, false);
+    memset(s->data, 0xFF, OTP_REG_SIZE);
+    s->erase = 1;
+    s->lo = OTP_REG_SIZE;
+    s->hi = 0;
+}
+
+void otp_flush()
+{
+    if (!otp_cached())
+    {
+        return;
+    }
+
+    for (uint8_t i = 0; i < OTP_MIRROR_SLOTS; i++)
+    {
+        otp_flush_slot(&otp_slots[i]);
+    }
+}
+
+void otp_invalidate()
+{
+    for (uint8_t i = 0; i < OTP_MIRROR_SLOTS; i++)
+    {
+        otp_slots[i].reg = 0;
+    }
+}
+
+uint8_t otp_locked()
+{
+    return (flash_read_status(0x35) >> OTP_SR2_LB_SHIFT) & 7;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <aes.h>
+#include <flash.h>
+#include <overlay.h>
+#include <overlays.h>
+
+#define OVERLAY_COUNT (sizeof(overlay_table) / sizeof(overlay_table[0]))
+
+_Static_assert(OVERLAY_SLOT_SIZE % AES_BLOCKLEN == 0, "the digest hashes whole slot blocks");
+
+static uint32_t overlay_slot[OVERLAY_SLOT_SIZE / 4];
+
+// One-entry cache: the ID the slot holds. Only overlay_load() writes the
+// slot, and only keeps an image that matched its digest.
+static int16_t overlay_id = -1;
+
+static const struct overlay_api_s overlay_api = {
+    .printf = printf,
+};
+
+// AES-128 Davies-Meyer, each 16 byte block is the key for the next step
+static bool overlay_verify(const struct overlay_entry_s * e)
+{
+    struct AES_ctx ctx;
+    uint8_t h[AES_BLOCKLEN] = { 0 }, prev[AES_BLOCKLEN];
+    uint8_t * image = (uint8_t *)overlay_slot;
+    uint16_t padded = (e->size + AES_BLOCKLEN - 1) & ~(AES_BLOCKLEN - 1);
+
+    memset(image + e->size, 0, padded - e->size);
+
+    for (unsigned i = 0; i < padded; i += AES_BLOCKLEN)
+    {
+        memcpy(prev, h, sizeof(h));
+        AES_init_ctx(&ctx, image + i);
+        AES_ECB_encrypt(&ctx, h);
+
+        for (unsigned j = 0; j < sizeof(h); j++)
+        {
+            h[j] ^= prev[j];
+        }
+    }
+
+    return !memcmp(h, e->digest, sizeof(h));
+}
+
+overlay_fn overlay_load(uint8_t id)
+{
+    const struct overlay_entry_s * e;
+
+    if (id >= OVERLAY_COUNT)
+    {
+        return NULL;
+    }
+
+    if (overlay_id == id)
+    {
+        return (overlay_fn)(void *)overlay_slot;
+    }
+
+    e = &overlay_table[id];
+
+    if (!e->size || e->size > sizeof(overlay_slot) || (e->size & 3))
+    {
+        return NULL;
+    }
+
+    overlay_id = -1;
+    flash_read(OVERLAY_ADDR + e->offset, overlay_slot, e->size);
+
+    if (!overlay_verify(e))
+    {
+        return NULL;
+    }
+
+    overlay_id = id;
+
+    return (overlay_fn)(void *)overlay_slot;
+}
+
+int overlay_call(uint8_t id, void * arg)
+{
+    overlay_fn fn = overlay_load(id);
+
+    if (!fn)
+    {
+        return OVERLAY_MISSING;
+    }
+
+    return fn(&overlay_api, arg);
+}
@@ -0,0 +1,41 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <flash.h>
+#include <overlay.h>
+
+// flash_print_stats() past the read throughput line, see struct
+// overlay_stats_s
+int __attribute__((section(".text.overlay_main"))) overlay_main(const struct overlay_api_s * api, void * arg)
+{
+    const struct overlay_stats_s * s = arg;
+    const struct flash_stats_s * st = s->stats;
+
+    api->printf("Update: %lu erases, %lu programs avoided\r\n",
+        st->erases_avoided,
+        st->programs_avoided);
+    api->printf("Suspend: %lu suspends, %lu resumes, %lu short waits, %lu forced waits\r\n",
+        st->suspends,
+        st->resumes,
+        st->short_waits,
+        st->forced_waits);
+    api->printf("Wait: %lu timeouts\r\n",
+        st->wait_timeouts);
+    api->printf("SPI: HCLK/%d\r\n", s->clk_div);
+    api->printf("Power: %lu sleeps, %lu wakes, %lu us per wake\r\n",
+        st->sleeps,
+        st->wakes,
+        s->wake_us);
+#if FLASH_CACHE_LINES
+    api->printf("Cache: %lu hits, %lu misses\r\n",
+        st->cache_hits,
+        st->cache_misses);
+#if FLASH_PREFETCH
+    api->printf("Prefetch: %lu lines, %lu used (%lu%%)\r\n",
+        st->prefetches,
+        st->prefetch_hits,
+        s->prefetch_pct);
+#endif
+#endif
+
+    return 0;
+}
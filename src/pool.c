@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ch32v003fun.h>
+#include <flash.h>
+#include <pool.h>
+
+// Blank check reads are longer than FLASH_CACHE_MAX_READ, so they don't
+// evict anything from the read cache
+#define POOL_CHECK_CHUNK 64
+
+static uint8_t pool_sector(struct pool_s * p, uint32_t addr)
+{
+    return (addr - p->base) / p->size;
+}
+
+static uint32_t pool_addr(struct pool_s * p, uint8_t s)
+{
+    return p->base + s * p->size;
+}
+
+void pool_init(struct pool_s * p, uint32_t base, uint32_t size, uint8_t count, uint8_t ahead)
+{
+    p->base = base;
+    p->size = size;
+    p->count = (count > POOL_MAX_SECTORS) ? POOL_MAX_SECTORS : count;
+    p->ahead = (ahead < p->count) ? ahead : p->count - 1;
+    p->cur = POOL_NONE;
+    p->next = 0;
+    p->job = -1;
+    p->checked = 0;
+    p->live = 0;
+    p->ready = 0;
+}
+
+void pool_claim(struct pool_s * p, uint32_t addr)
+{
+    p->live |= 1ul << pool_sector(p, addr);
+}
+
+void pool_release(struct pool_s * p, uint32_t addr)
+{
+    p->live &= ~(1ul << pool_sector(p, addr));
+}
+
+uint8_t pool_ready(struct pool_s * p)
+{
+    uint8_t n = 0;
+
+    for (uint32_t r = p->ready; r; r &= r - 1)
+    {
+        n++;
+    }
+
+    return n;
+}
+
+// First sector from the round robin cursor that's in none of the masks
+static uint8_t pool_pick(struct pool_s * p, uint32_t skip)
+{
+    for (unsigned i = 0; i < p->count; i++)
+    {
+        uint8_t s = (p->next + i) % p->count;
+
+        if (!(skip & (1ul << s)))
+        {
+            return s;
+        }
+    }
+
+    return POOL_NONE;
+}
+
+uint32_t pool_take(struct pool_s * p)
+{
+    uint8_t s = pool_pick(p, ~p->ready);
+
+    if (s == POOL_NONE && p->cur != POOL_NONE && p->job >= 0)
+    {
+        // Its erase is already on the way, cheaper than starting another
+        s = p->cur;
+
+        while (!flash_job_done(p->job))
+        {
+            // flash_job_poll() leaves the bus alone during a CLI session,
+            // the erase can't finish until it's over
+            if (SPI1->CTLR1 & SPI_CTLR1_SPE)
+            {
+                return POOL_FULL;
+            }
+            flash_job_poll();
+        }
+    }
+    else if (s == POOL_NONE)
+    {
+        // Nothing erased yet (first append after a reset), pay for it now
+        s = pool_pick(p, p->live);
+
+        if (s == POOL_NONE)
+        {
+            return POOL_FULL;
+        }
+
+        flash_erase_block(pool_addr(p, s));
+    }
+
+    if (s == p->cur)
+    {
+        p->cur = POOL_NONE;
+        p->job = -1;
+    }
+
+    p->ready &= ~(1ul << s);
+    p->live |= 1ul << s;
+    p->next = (s + 1u) % p->count;
+
+    return pool_addr(p, s);
+}
+
+void pool_poll(struct pool_s * p)
+{
+    uint8_t chunk[POOL_CHECK_CHUNK];
+    uint32_t addr;
+
+    // a CLI BEGIN..END session (or an open stream) owns the bus
+    if (SPI1->CTLR1 & SPI_CTLR1_SPE)
+    {
+        return;
+    }
+
+    if (p->cur == POOL_NONE)
+    {
+        if (pool_ready(p) >= p->ahead)
+        {
+            return;
+        }
+
+        p->cur = pool_pick(p, p->live | p->ready);
+
+        if (p->cur == POOL_NONE)
+        {
+            return;
+        }
+
+        p->job = -1;
+        p->checked = 0;
+    }
+
+    addr = pool_addr(p, p->cur);
+
+    if (p->job >= 0)
+    {
+        if (!flash_job_done(p->job))
+        {
+            return;
+        }
+    }
+    else
+    {
+        // Often erased already, a read is much cheaper than an erase
+        flash_read(addr + p->checked, chunk, sizeof(chunk));
+
+        for (unsigned i = 0; i < sizeof(chunk); i++)
+        {
+            if (chunk[i] != 0xFF)
+            {
+                // Retried on the next call if the queue is full
+                p->job = flash_job_erase(addr, NULL);
+
+                return;
+            }
+        }
+
+        p->checked += sizeof(chunk);
+
+        if (p->checked < p->size)
+        {
+            return;
+        }
+    }
+
+    p->ready |= 1ul << p->cur;
+    p->cur = POOL_NONE;
+    p->job = -1;
+}
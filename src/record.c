@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <flash.h>
+#include <record.h>
+
+static uint32_t record_check(const struct record_hdr_s * h, const uint8_t * p)
+{
+    uint32_t sum = ((uint32_t)h->type << 16) | h->len;
+
+    for (unsigned i = 0; i < h->len; i++)
+    {
+        sum = (sum << 5) + sum + p[i];
+    }
+
+    return ~sum;
+}
+
+size_t record_read(uint32_t addr, void * buf, size_t max, void * tail, size_t tail_len)
+{
+    size_t len;
+
+    flash_stream_open(addr, sizeof(len) + max + tail_len);
+    flash_stream_read(&len, sizeof(len));
+
+    len = (len < max) ? len : max;
+    flash_stream_read(buf, len);
+
+    if (tail)
+    {
+        flash_stream_read(tail, tail_len);
+    }
+
+    flash_stream_close();
+
+    return len;
+}
+
+int record_get(uint32_t addr, uint16_t type, void * buf, size_t max)
+{
+    struct record_hdr_s h;
+
+    flash_stream_open(addr, sizeof(h) + max);
+    flash_stream_read(&h, sizeof(h));
+
+    if (h.type != type || h.len > max)
+    {
+        flash_stream_close();
+
+        return -1;
+    }
+
+    flash_stream_read(buf, h.len);
+    flash_stream_close();
+
+    return (h.check == record_check(&h, buf)) ? h.len : -1;
+}
+
+bool record_put(uint32_t addr, uint16_t type, const void * buf, size_t len)
+{
+    struct
+    {
+        struct record_hdr_s h;
+        uint8_t payload[RECORD_PAYLOAD_MAX];
+    } rec;
+
+    if (len > RECORD_PAYLOAD_MAX)
+    {
+        return false;
+    }
+
+    rec.h.type = type;
+    rec.h.len = len;
+    memcpy(rec.payload, buf, len);
+    rec.h.check = record_check(&rec.h, rec.payload);
+
+    return flash_update(addr, &rec, sizeof(rec.h) + len) != FLASH_UPDATE_FAILED;
+}
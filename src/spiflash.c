@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <flash.h>
+#include <overlay.h>
 
 #define CH32V003_SPI_SPEED_HZ (100000000/3)
 // #define CH32V003_SPI_SPEED_HZ 50000000
@@ -14,50 +15,272 @@
 
 #include <ch32v003_SPI.h>
 
-#define CSASSERT()       funDigitalWrite(cs, FUN_LOW)
-#define CSRELEASE()       funDigitalWrite(cs, FUN_HIGH)
+#define CSASSERT()       funDigitalWrite(flash_dev->cs, FUN_LOW)
+#define CSRELEASE()       funDigitalWrite(flash_dev->cs, FUN_HIGH)
 
 #define FLAG_32BIT_ADDR		0x01	// larger than 16 MByte address
 #define FLAG_STATUS_CMD70	0x02	// requires special busy flag check
-#define FLAG_DIFF_SUSPEND	0x04	// uses 2 different suspend commands
 #define FLAG_MULTI_DIE		0x08	// multiple die, don't read cross 32M barrier
 #define FLAG_256K_BLOCKS	0x10	// has 256K erase blocks
 #define FLAG_DIE_MASK		0xC0	// top 2 bits count during multi-die erase
 
-static int cs = -1;
-static uint8_t flags = 0;
-static uint8_t busy = 0;
+#define BUSY_PROGRAM		1	// page program, suspendable
+#define BUSY_ERASE		2	// sector/block erase, suspendable
+#define BUSY_OTHER		3	// chip erase, security registers: can't suspend
+#define SUSPEND_FAILED		0xFF	// flash_suspend(): the chip never got ready
+
+// Typical W25Q128 timings, used to guess how long a busy chip still needs
+#define FLASH_TPP_US		400
+#define FLASH_TSE_US		45000	// 4K
+#define FLASH_TBE1_US		120000	// 32K
+#define FLASH_TBE2_US		150000	// 64K and up
+
+static uint8_t read_mode = FLASH_READ_DEFAULT;
 
 struct _ext_cmds_s flash_ext_cmds;
+struct flash_stats_s flash_stats;
 
-static void flash_wait()
+#if FLASH_TRACE_ENTRIES
+static struct flash_trace_s trace[FLASH_TRACE_ENTRIES];
+static uint32_t trace_total;
+
+// Called once CS is released, start is the SysTick from before it went low
+void flash_trace(uint8_t op, uint32_t addr, uint32_t len, uint32_t start)
 {
-    uint32_t status;
+	struct flash_trace_s *t = &trace[trace_total++ & (FLASH_TRACE_ENTRIES - 1)];
+	uint32_t ticks = SysTick->CNT - start;
+	uint8_t e = 0;
+
+	while (ticks >> FLASH_TRACE_DUR_BITS) {
+		ticks >>= 1;
+		e++;
+	}
+	t->start = start;
+	t->op_addr = ((uint32_t)op << 24) | (addr & 0xFFFFFF);
+	t->len = (len > 0xFFFF) ? 0xFFFF : len;
+	t->dur = (e > 15) ? 0xFFFF : (e << FLASH_TRACE_DUR_BITS) | ticks;
+}
 
-    while (1)
-    {
-        SPI_begin_8();
-        CSASSERT();
+void flash_trace_dump()
+{
+	struct flash_trace_hdr_s h = {
+		.magic = FLASH_TRACE_MAGIC,
+		.size = sizeof(struct flash_trace_s),
+		.dur_bits = FLASH_TRACE_DUR_BITS,
+		.ticks_us = DELAY_US_TIME,
+	};
+	uint32_t first;
 
-		if (flags & FLAG_STATUS_CMD70)
-		{
-		    SPI_transfer_8(0x70);
-		    status = SPI_transfer_8(0);
-		    CSRELEASE();
-            SPI_end();
+	h.total = trace_total;
+	h.count = (trace_total < FLASH_TRACE_ENTRIES) ? trace_total : FLASH_TRACE_ENTRIES;
+	_write(0, (const char *)&h, sizeof(h));
+	first = trace_total - h.count;
+	for (uint32_t i = first; i != trace_total; i++) {
+		_write(0, (const char *)&trace[i & (FLASH_TRACE_ENTRIES - 1)], sizeof(struct flash_trace_s));
+	}
+}
+#endif
+
+// W25Q128 defaults, replaced by whatever SFDP reports
+static const struct flash_geom_s flash_geom_default = {
+	.erase_op = { 0x20, 0x52, 0xD8, 0 },
+	.erase_shift = { 12, 15, 16, 0 },
+	.block_op = 0x52,
+	.block_shift = 15,
+	.read_op = 0x0B,
+	.read_dummy = 8,
+	.erase_suspend = 0x75,
+	.erase_resume = 0x7A,
+	.prog_suspend = 0x75,
+	.prog_resume = 0x7A,
+};
+
+struct flash_dev_s flash_dev0 = { .cs = -1 };
+#if FLASH_MULTI_DEV
+struct flash_dev_s * flash_dev = &flash_dev0;
+static struct flash_dev_s * flash_devs;	// every device that answered flash_dev_init()
+
+#define flash_dev_set(d)	(flash_dev = (d))
+#else
+// flash_dev0 is all there is, nothing to switch
+#define flash_devs		(&flash_dev0)
+#define flash_dev_set(d)	((void)(d))
+
+static inline struct flash_dev_s * flash_select(struct flash_dev_s * dev)
+{
+	return dev;
+}
+#endif
+
+static void flash_job_sync();
+static void flash_stream_park();
+
+static void flash_busy_set(uint8_t b, uint32_t us, uint32_t addr, uint32_t len)
+{
+	flash_dev->busy = b;
+	flash_dev->busy_addr = addr;
+	flash_dev->busy_len = len;
+	flash_dev->busy_start = SysTick->CNT;
+	flash_dev->busy_ticks = us * DELAY_US_TIME;
+}
+
+static flash_yield_cb flash_yield;
+
+void flash_set_yield(flash_yield_cb yield)
+{
+	flash_yield = yield;
+}
+
+// One status opcode, then the register is clocked out again and again
+// under the same CS until the chip is done. Returns false on timeout, the
+// device stays busy then.
+static bool flash_wait_poll(uint32_t timeout_ms, flash_yield_cb yield)
+{
+	uint32_t polls = 0, start = SysTick->CNT;
+	uint8_t op, mask, ready;
+	bool ok = true;
+
+	if (flash_dev->flags & FLAG_STATUS_CMD70) {
+		op = 0x70;
+		mask = ready = 0x80;
+	} else {
+		op = 0x05;
+		mask = 0x01;
+		ready = 0;
+	}
+
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(op);
+	while ((SPI_transfer_8(0) & mask) != ready) {
+		polls++;
+		if (timeout_ms && SysTick->CNT - start >= timeout_ms * 1000ul * DELAY_US_TIME) {
+			ok = false;
+			break;
+		}
+		if (yield) yield();
+	}
+	CSRELEASE();
+	SPI_end();
+	flash_trace(op, flash_dev->busy_addr, polls + 1, start);
+
+	if (ok) {
+		flash_dev->busy = 0;
+	} else {
+		flash_stats.wait_timeouts++;
+	}
+
+	return ok;
+}
+
+static bool flash_wait()
+{
+	// a whole chip erase can take minutes, don't give up on it
+	return flash_wait_poll(flash_dev->busy_ticks ? FLASH_WAIT_TIMEOUT_MS : 0, flash_yield);
+}
+
+// Before a WREN: false if the chip never finished what it was doing, the
+// next command would be dropped or land in the middle of it
+static bool flash_idle()
+{
+	return !flash_dev->busy || flash_wait();
+}
+
+bool flash_wait_ready(uint32_t timeout_ms, flash_yield_cb yield)
+{
+	flash_read_wait();
+	return flash_wait_poll(timeout_ms, yield);
+}
+
+// Single status probe, clears busy once the chip is done.
+// Returns true while the chip is still working.
+static bool flash_busy_poll()
+{
+	uint8_t status;
+	uint32_t start;
+
+	if (!flash_dev->busy) return false;
+
+	start = SysTick->CNT;
+	SPI_begin_8();
+	CSASSERT();
+	if (flash_dev->flags & FLAG_STATUS_CMD70) {
+		SPI_transfer_8(0x70);
+		status = SPI_transfer_8(0);
+		if ((status & 0x80)) flash_dev->busy = 0;
+	} else {
+		SPI_transfer_8(0x05);
+		status = SPI_transfer_8(0);
+		if (!(status & 1)) flash_dev->busy = 0;
+	}
+	CSRELEASE();
+	SPI_end();
+	// only the poll that sees the chip finish, idle polling would flood
+	// the ring
+	if (!flash_dev->busy) {
+		flash_trace((flash_dev->flags & FLAG_STATUS_CMD70) ? 0x70 : 0x05, flash_dev->busy_addr, 1, start);
+	}
+
+	return flash_dev->busy != 0;
+}
+
+bool flash_is_busy()
+{
+	flash_read_wait();
+	return flash_busy_poll();
+}
+
+// SPI1 clock for the selected device. SPE is off between transactions,
+// and the CLI's BEGIN resets the prescaler, so it is set again on every
+// driver call.
+static void flash_spi_clock()
+{
+	SPI1->CTLR1 = (SPI1->CTLR1 & ~SPI_CTLR1_BR) | (SPI_CTLR1_BR & (flash_dev->br << 3));
+}
+
+// Every driver call comes through here (by way of flash_read_wait()), so
+// a powered down chip is released before anything else goes out
+void flash_wake()
+{
+	uint32_t start;
+
+	flash_spi_clock();
+	flash_dev->last_access = SysTick->CNT;
+	if (!flash_dev->pdown) return;
+
+	start = flash_dev->last_access;
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(0xAB); // release power-down
+	CSRELEASE();
+	SPI_end();
+	Delay_Us(FLASH_TRES1_US);
+	flash_trace(0xAB, 0, 0, start);
+	flash_dev->pdown = 0;
+	flash_stats.wakes++;
+	flash_stats.wake_ticks += SysTick->CNT - start;
+}
 
-            if ((status & 0x80)) break;
-        }
-        else
-        {
-		    SPI_transfer_8(0x5);
-		    status = SPI_transfer_8(0);
-		    CSRELEASE();
-            SPI_end();
+// Called from the idle loop, drops the chip into deep power-down once
+// nothing has touched it for FLASH_PDOWN_IDLE_MS
+static void flash_sleep_check()
+{
+#if FLASH_PDOWN_IDLE_MS
+	uint32_t start;
+
+	if (flash_dev->pdown || flash_busy_poll()) return;
+	start = SysTick->CNT;
+	if (start - flash_dev->last_access < FLASH_PDOWN_IDLE_MS * 1000ul * DELAY_US_TIME) return;
 
-			if (!(status & 1)) break;
-        }
-    }
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(0xB9); // deep power-down
+	CSRELEASE();
+	SPI_end();
+	flash_trace(0xB9, 0, 0, start);
+	flash_dev->pdown = 1;
+	flash_stats.sleeps++;
+#endif
 }
 
 #define ID0_WINBOND	0xEF
@@ -69,7 +292,11 @@ static void flash_wait()
 
 void flash_read_id(uint8_t * buf)
 {
-	if (busy) flash_wait();
+	uint32_t start;
+
+	flash_read_wait();
+	if (flash_dev->busy) flash_wait();
+	start = SysTick->CNT;
 	SPI_begin_8();
 	CSASSERT();
 	SPI_transfer_8(0x9F);
@@ -82,6 +309,7 @@ void flash_read_id(uint8_t * buf)
 	}
 	CSRELEASE();
 	SPI_end();
+	flash_trace(0x9F, 0, (buf[0] == ID0_SPANSION) ? 5 : 3, start);
 }
 
 uint32_t flash_capacity(const uint8_t *id)
@@ -105,17 +333,128 @@ uint32_t flash_capacity(const uint8_t *id)
 	return n;
 }
 
-bool flash_init(int cs_pin)
+static void flash_read_sfdp(uint32_t addr, void * buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t start = SysTick->CNT;
+
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(0x5A);
+	SPI_transfer_8(addr >> 16);
+	SPI_transfer_8(addr >> 8);
+	SPI_transfer_8(addr);
+	SPI_transfer_8(0); // 8 dummy clocks
+	for (size_t i = len; i; i--) {
+		*p++ = SPI_transfer_8(0);
+	}
+	CSRELEASE();
+	SPI_end();
+	flash_trace(0x5A, addr, len, start);
+}
+
+// Fill the device geometry from the JEDEC Basic Flash Parameter Table. Only the
+// DWORDs the driver acts on are fetched. Returns false when the part has
+// no SFDP, the geometry keeps its defaults then.
+static bool flash_sfdp()
+{
+	struct flash_geom_s *g = &flash_dev->geom;
+	uint32_t hdr[4];
+	uint32_t dw[2];
+	uint32_t bfpt, dwords;
+	uint8_t i, n, shift;
+
+	flash_read_sfdp(0, hdr, sizeof(hdr));
+	if (hdr[0] != SFDP_SIGNATURE) return false;
+	// first parameter header has to be the BFPT, ID 0xFF00
+	if ((hdr[2] & 0xFF) != 0x00 || (hdr[3] >> 24) != 0xFF) return false;
+	dwords = hdr[2] >> 24;
+	bfpt = hdr[3] & 0xFFFFFF;
+	if (dwords < 9) return false;
+
+	// DWORD 1: 4K erase opcode, address bytes. DWORD 2: density
+	flash_read_sfdp(bfpt, dw, sizeof(dw));
+	g->addr4 = (dw[0] >> 17) & 3;
+	if (dw[1] & 0x80000000) {
+		shift = dw[1] & 0x7FFFFFFF;
+		g->size = (shift >= 35) ? 0xFFFFFFFF : (1ul << (shift - 3));
+	} else {
+		g->size = (dw[1] >> 3) + 1;
+	}
+
+	// DWORDs 8 and 9: up to four erase types, size exponent + opcode
+	flash_read_sfdp(bfpt + 7 * 4, dw, sizeof(dw));
+	for (i = 0, n = 0; i < 4; i++) {
+		uint16_t t = dw[i >> 1] >> ((i & 1) * 16);
+		if (!(t & 0xFF) || !(t >> 8)) continue;
+		g->erase_shift[n] = t & 0xFF;
+		g->erase_op[n++] = t >> 8;
+	}
+	while (n < 4) {
+		g->erase_shift[n] = 0;
+		g->erase_op[n++] = 0;
+	}
+
+	// 1-1-1 FAST_READ isn't described by the BFPT, JESD216 fixes it at
+	// 0x0B with 8 dummy clocks on every part that has SFDP.
+	g->read_op = 0x0B;
+	g->read_dummy = 8;
+
+	// DWORDs 12 and 13 (JESD216A+): suspend/resume
+	if (dwords >= 13) {
+		flash_read_sfdp(bfpt + 11 * 4, dw, sizeof(dw));
+		if (dw[0] & 0x80000000) {
+			g->erase_suspend = 0;
+			g->prog_suspend = 0;
+		} else {
+			g->erase_suspend = dw[1] >> 24;
+			g->erase_resume = dw[1] >> 16;
+			g->prog_suspend = dw[1] >> 8;
+			g->prog_resume = dw[1];
+		}
+	}
+
+	g->sfdp = 1;
+
+	return true;
+}
+
+// flash_erase_block() promises its callers exactly one 32K block: the
+// largest erase type that fits in one, repeated when it's smaller. A part
+// with nothing that small (only 64K and up) gets no block erase at all.
+static void flash_pick_block_erase()
+{
+	struct flash_geom_s *g = &flash_dev->geom;
+
+	g->block_op = 0;
+	g->block_shift = 0;
+	for (uint8_t i = 0; i < 4; i++) {
+		if (!g->erase_op[i] || g->erase_shift[i] > FLASH_BLOCK_SHIFT) continue;
+		if (!g->block_op || g->erase_shift[i] > g->block_shift) {
+			g->block_shift = g->erase_shift[i];
+			g->block_op = g->erase_op[i];
+		}
+	}
+}
+
+// Identify the selected device and fill in its flags and geometry
+static bool flash_probe()
 {
 	uint8_t id[5];
 	uint8_t f;
 	uint32_t size;
 
-    cs = cs_pin;
-
     SPI_init();
+#if FLASH_USE_DMA
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+#endif
 
-	funPinMode( cs, GPIO_Speed_10MHz | GPIO_CNF_OUT_PP );
+	funPinMode( flash_dev->cs, GPIO_Speed_10MHz | GPIO_CNF_OUT_PP );
+	// every chip on the bus has to be deselected before anything goes out
+	CSRELEASE();
+
+	// still powered down if this is a soft reboot, it won't answer the ID
+	flash_dev->pdown = 1;
 
     flash_read_id(id);
 
@@ -127,6 +466,12 @@ bool flash_init(int cs_pin)
 	f = 0;
 
 	size = flash_capacity(id);
+	if (flash_sfdp()) {
+		size = flash_dev->geom.size;
+		if (flash_dev->geom.addr4 == SFDP_ADDR_4BYTE_ONLY) f |= FLAG_32BIT_ADDR;
+	}
+	flash_dev->geom.size = size;
+	flash_pick_block_erase();
 	if (size > 16777216) {
 		// more than 16 Mbyte requires 32 bit addresses
 		f |= FLAG_32BIT_ADDR;
@@ -158,7 +503,10 @@ bool flash_init(int cs_pin)
 	}
 	if (id[0] == ID0_SPANSION) {
 		// Spansion has separate suspend commands
-		f |= FLAG_DIFF_SUSPEND;
+		if (!flash_dev->geom.sfdp) {
+			flash_dev->geom.prog_suspend = 0x85;
+			flash_dev->geom.prog_resume = 0x8A;
+		}
 		if (!id[4]) {
 			// Spansion chips with id[4] == 0 use 256K sectors
 			f |= FLAG_256K_BLOCKS;
@@ -168,288 +516,1449 @@ bool flash_init(int cs_pin)
 		// Micron requires busy checks with a different command
 		f |= FLAG_STATUS_CMD70; // TODO: all or just multi-die chips?
 	}
-	flags = f;
+	flash_dev->flags = f;
 	flash_read_id(id);
 
     return true;
 }
 
-void flash_read(uint32_t addr, void * buf, size_t len)
+// Set up the selected device for cs_pin, then identify it
+static bool flash_dev_probe(int cs_pin)
 {
-	uint8_t *p = (uint8_t *)buf;
-	uint8_t b, f, status, cmd;
-
-	memset(p, 0, len);
-	f = flags;
-    SPI_begin_16();
-	b = busy;
-	if (b) {
-		// read status register ... chip may no longer be busy
-		CSASSERT();
-		if (flags & FLAG_STATUS_CMD70) {
-			SPI_transfer_8(0x70);
-			status = SPI_transfer_8(0);
-			if ((status & 0x80)) b = 0;
-		} else {
-			SPI_transfer_8(0x05);
-			status = SPI_transfer_8(0);
-			if (!(status & 1)) b = 0;
-		}
-		CSRELEASE();
-		if (b == 0) {
-			// chip is no longer busy :-)
-			busy = 0;
-		} else if (b < 3) {
-			// TODO: this may not work on Spansion chips
-			// which apparently have 2 different suspend
-			// commands, for program vs erase
-			CSASSERT();
-			SPI_transfer_8(0x06); // write enable (Micron req'd)
-			CSRELEASE();
-			Delay_Us(1);
-			cmd = 0x75; //Suspend program/erase for almost all chips
-			// but Spansion just has to be different for program suspend!
-			if ((f & FLAG_DIFF_SUSPEND) && (b == 1)) cmd = 0x85;
-			CSASSERT();
-			SPI_transfer_8(cmd); // Suspend command
-			CSRELEASE();
-			if (f & FLAG_STATUS_CMD70) {
-				// Micron chips don't actually suspend until flags read
-				CSASSERT();
-				SPI_transfer_8(0x70);
-				do {
-					status = SPI_transfer_8(0);
-				} while (!(status & 0x80));
-				CSRELEASE();
-			} else {
-				CSASSERT();
-				SPI_transfer_8(0x05);
-				do {
-					status = SPI_transfer_8(0);
-				} while ((status & 0x01));
-				CSRELEASE();
-			}
-		} else {
-			// chip is busy with an operation that can not suspend
-			SPI_end();	// is this a good idea?
-			flash_wait();			// should we wait without ending
-			b = 0;			// the transaction??
-			SPI_begin_16();
-		}
-	}
-	do {
-		uint32_t rdlen = len;
-		if (f & FLAG_MULTI_DIE) {
-			if ((addr & 0xFE000000) != ((addr + len - 1) & 0xFE000000)) {
-				rdlen = 0x2000000 - (addr & 0x1FFFFFF);
-			}
-		}
-		CSASSERT();
-		// TODO: FIFO optimize....
-		if (f & FLAG_32BIT_ADDR) {
-			SPI_transfer_8(0x03);
-			SPI_transfer_16(addr >> 16);
-			SPI_transfer_16(addr);
-		} else {
-			SPI_transfer_16(0x0300 | ((addr >> 16) & 255));
-			SPI_transfer_16(addr);
-		}
-		for (int i = 0; i < rdlen; i+=2)
-		{
-    		uint16_t data = SPI_transfer_16(0);
-    		p[i] = data >> 8;
+	flash_dev->cs = cs_pin;
+	flash_dev->flags = 0;
+	flash_dev->busy = 0;
+	flash_dev->br = SPI_CLK_PRESCALER;
+	flash_dev->geom = flash_geom_default;
 
-    		if (i + 1 < rdlen)
-    		{
-    	    	p[i + 1] = data & 0xff;
-    		}
-		}
-		CSRELEASE();
-		p += rdlen;
-		addr += rdlen;
-		len -= rdlen;
-	} while (len > 0);
-	if (b) {
-		CSASSERT();
-		SPI_transfer_8(0x06); // write enable (Micron req'd)
-		CSRELEASE();
-		Delay_Us(1);
-		cmd = 0x7A;
-		if ((f & FLAG_DIFF_SUSPEND) && (b == 1)) cmd = 0x8A;
-		CSASSERT();
-		SPI_transfer_8(cmd); // Resume program/erase
-		CSRELEASE();
-	}
-	SPI_end();
+	return flash_probe();
 }
 
-void flash_read_status_registers()
+#if FLASH_MULTI_DEV
+struct flash_dev_s * flash_select(struct flash_dev_s * dev)
 {
-    int status;
-    // SPI_begin_8();
-    CSASSERT();
-    SPI_transfer_8(0x05);
-    status = SPI_transfer_8(0);
-    printf("Status register 1 = 0x%x\r\n", status);
-    CSRELEASE();
-	// SPI_end();
+	struct flash_dev_s *prev = flash_dev;
 
-    // SPI_begin_8();
-    CSASSERT();
-    SPI_transfer_8(0x35);
-    status = SPI_transfer_8(0);
-    printf("Status register 2 = 0x%x\r\n", status);
-    CSRELEASE();
-	// SPI_end();
+	if (dev == prev) return prev;
+	// the bus is shared: hand it over with CS released, a busy
+	// program/erase on the old device just keeps running
+	flash_stream_park();
+	while (!flash_read_done());
+	flash_dev = dev;
+	flash_spi_clock();
 
-    // SPI_begin_8();
-    CSASSERT();
-    SPI_transfer_8(0x15);
-    status = SPI_transfer_8(0);
-    printf("Status register 3 = 0x%x\r\n", status);
-    CSRELEASE();
-	// SPI_end();
+	return prev;
 }
 
-void flash_erase_block_ext(uint32_t addr)
+bool flash_dev_init(struct flash_dev_s * dev, int cs_pin)
 {
-	if (busy) flash_wait();
-	SPI_begin_8();
-	CSASSERT();
-	SPI_transfer_8(0x06); // write enable command
-	CSRELEASE();
-	Delay_Us(1);
+	struct flash_dev_s *prev, *d;
+	bool ok;
 
-	CSASSERT();
-	SPI_transfer_8(flash_ext_cmds.erase); // 0x44
-	SPI_transfer_8(((addr >> 16) & 0xff));
-	SPI_transfer_8((addr >> 8) & 0xff);
-	SPI_transfer_8(addr & 0xff);
-	CSRELEASE();
-	SPI_end();
-	busy = 2;
+	prev = flash_select(dev);
+	ok = flash_dev_probe(cs_pin);
+	if (ok) {
+		for (d = flash_devs; d && d != dev; d = d->next);
+		if (!d) {
+			dev->next = flash_devs;
+			flash_devs = dev;
+		}
+	}
+	flash_select(prev);
+
+	return ok;
 }
 
-void flash_read_ext(uint32_t addr, void * buf, size_t len)
+#endif // FLASH_MULTI_DEV
+
+bool flash_init(int cs_pin)
 {
-	uint8_t *p = (uint8_t *)buf;
+#if FLASH_MULTI_DEV
+	return flash_dev_init(&flash_dev0, cs_pin);
+#else
+	return flash_dev_probe(cs_pin);
+#endif
+}
+
+// Every read path calls this before touching the array. If the chip is
+// still busy, the operation is suspended so the read goes through right
+// away. It is waited out instead when it can't be suspended, when the read
+// overlaps the range being changed (a suspended program or erase leaves it
+// half done), or when it is expected to finish within
+// FLASH_SUSPEND_BUDGET_US anyway, which is cheaper than a suspend/resume
+// round trip. Returns the busy state that has to be handed to
+// flash_resume() once the read is done (0 if nothing to do), or
+// SUSPEND_FAILED when the chip stays busy past FLASH_WAIT_TIMEOUT_MS after
+// the suspend. The array can't be read then.
+static uint8_t flash_suspend(uint8_t f, uint32_t addr, uint32_t len)
+{
+	uint8_t b, status, cmd, op, mask, ready;
+	uint32_t elapsed, start;
+	bool ok = true;
 
-	if (busy)
-	    flash_wait();
+	b = flash_dev->busy;
+	if (!b) return 0;
 
-	memset(p, 0, len);
-    SPI_begin_8();
-	len = MIN(len, 256);
+	SPI_begin_8();
+	// read status register ... chip may no longer be busy
 	CSASSERT();
-	SPI_transfer_8(flash_ext_cmds.read); // 0x48
-	SPI_transfer_8(((addr >> 16) & 0xff));
-	SPI_transfer_8((addr >> 8) & 0xff);
-	SPI_transfer_8(addr & 0xff);
+	if (f & FLAG_STATUS_CMD70) {
+		SPI_transfer_8(0x70);
+		status = SPI_transfer_8(0);
+		if ((status & 0x80)) b = 0;
+	} else {
+		SPI_transfer_8(0x05);
+		status = SPI_transfer_8(0);
+		if (!(status & 1)) b = 0;
+	}
+	CSRELEASE();
+	if (b == 0) {
+		// chip is no longer busy :-)
+		flash_dev->busy = 0;
+		SPI_end();
+		return 0;
+	}
 
-	// Write a dummy byte
-	SPI_transfer_8(0);
+	cmd = 0;
+	if (b == BUSY_PROGRAM) cmd = flash_dev->geom.prog_suspend;
+	if (b == BUSY_ERASE) cmd = flash_dev->geom.erase_suspend;
+	if (addr < flash_dev->busy_addr + flash_dev->busy_len && flash_dev->busy_addr < addr + len) cmd = 0;
+	if (!cmd) {
+		// chip is busy with an operation that can not suspend, the part
+		// told us through SFDP that it has no suspend at all, or the
+		// read wants the data that is being changed
+		SPI_end();
+		flash_stats.forced_waits++;
+		flash_wait();
+		return 0;
+	}
 
-	for (int i = 0; i < len; i++)
-	{
-	    p[i] = SPI_transfer_8(0);
+	elapsed = SysTick->CNT - flash_dev->busy_start;
+	if (elapsed < flash_dev->busy_ticks && flash_dev->busy_ticks - elapsed <= FLASH_SUSPEND_BUDGET_US * DELAY_US_TIME) {
+		// almost done, not worth the suspend latency
+		SPI_end();
+		flash_stats.short_waits++;
+		flash_wait();
+		return 0;
+	}
+
+	start = SysTick->CNT;
+	CSASSERT();
+	SPI_transfer_8(0x06); // write enable (Micron req'd)
+	CSRELEASE();
+	Delay_Us(1);
+	CSASSERT();
+	SPI_transfer_8(cmd); // Suspend command
+	CSRELEASE();
+	// Micron chips don't actually suspend until flags read
+	if (f & FLAG_STATUS_CMD70) {
+		op = 0x70;
+		mask = ready = 0x80;
+	} else {
+		op = 0x05;
+		mask = 0x01;
+		ready = 0;
+	}
+	CSASSERT();
+	SPI_transfer_8(op);
+	while ((SPI_transfer_8(0) & mask) != ready) {
+		if (SysTick->CNT - start >= FLASH_WAIT_TIMEOUT_MS * 1000ul * DELAY_US_TIME) {
+			ok = false;
+			break;
+		}
 	}
 	CSRELEASE();
 	SPI_end();
+	// includes the wait for the chip to actually suspend
+	flash_trace(cmd, flash_dev->busy_addr, 0, start);
+	if (!ok) {
+		// still busy, the operation stays on the books as it was
+		flash_stats.wait_timeouts++;
+		return SUSPEND_FAILED;
+	}
+	flash_dev->suspend_start = SysTick->CNT;
+	flash_stats.suspends++;
+
+	return b;
 }
 
-void flash_write_ext(uint32_t addr, void * buf, size_t len)
+static void flash_resume(uint8_t b, uint8_t f)
 {
+	uint8_t cmd;
+	uint32_t start;
 
-	const uint8_t *p = (const uint8_t *)buf;
-
-	len = MIN(len, 256);
+	if (!b) return;
 
-	if (busy) flash_wait();
+	start = SysTick->CNT;
 	SPI_begin_8();
 	CSASSERT();
-	// write enable command
-	SPI_transfer_8(0x06);
+	SPI_transfer_8(0x06); // write enable (Micron req'd)
 	CSRELEASE();
-
 	Delay_Us(1);
+	cmd = (b == BUSY_PROGRAM) ? flash_dev->geom.prog_resume : flash_dev->geom.erase_resume;
 	CSASSERT();
-	SPI_transfer_8(flash_ext_cmds.write); // 0x42
-	SPI_transfer_8(((addr >> 16) & 0xff));
-	SPI_transfer_8((addr >> 8) & 0xff);
-	SPI_transfer_8(addr & 0xff);
-
-	do {
-		SPI_transfer_8(*p++);
-	} while (--len > 0);
+	SPI_transfer_8(cmd); // Resume program/erase
 	CSRELEASE();
-	busy = 4;
 	SPI_end();
+	flash_trace(cmd, flash_dev->busy_addr, 0, start);
+	// the operation made no progress while suspended
+	flash_dev->busy_start += SysTick->CNT - flash_dev->suspend_start;
+	flash_stats.resumes++;
 }
 
-void flash_write(uint32_t addr, void * buf, size_t len)
+// CS asserted, SPI in 8 bit mode, fast read command + address + dummy sent
+static void flash_fast_cmd(uint32_t addr, uint8_t f)
 {
-	const uint8_t *p = (const uint8_t *)buf;
-	uint32_t max, pagelen;
-
-	do {
-		if (busy) flash_wait();
-		SPI_begin_8();
-		CSASSERT();
-		// write enable command
-		SPI_transfer_8(0x06);
-		CSRELEASE();
-
-		max = 256 - (addr & 0xFF);
-		pagelen = (len <= max) ? len : max;
-		Delay_Us(1); // TODO: reduce this, but prefer safety first
-		CSASSERT();
-		if (flags & FLAG_32BIT_ADDR) {
-    		SPI_transfer_8(0x02); // program page command
-			SPI_transfer_16(addr >> 16);
-			SPI_transfer_16(addr);
-		} else {
-			SPI_transfer_8(0x02);
-			SPI_transfer_8(((addr >> 16) & 0xff));
-			SPI_transfer_8((addr >> 8) & 0xff);
-			SPI_transfer_8(addr & 0xff);
-		}
-		addr += pagelen;
-		len -= pagelen;
-		do {
-			SPI_transfer_8(*p++);
-		} while (--pagelen > 0);
-		CSRELEASE();
-		busy = 4;
-		SPI_end();
-	} while (len > 0);
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(flash_dev->geom.read_op);
+	if (f & FLAG_32BIT_ADDR) {
+		SPI_transfer_8(addr >> 24);
+	}
+	SPI_transfer_8(addr >> 16);
+	SPI_transfer_8(addr >> 8);
+	SPI_transfer_8(addr);
+	for (uint8_t d = flash_dev->geom.read_dummy; d; d -= 8) {
+		SPI_transfer_8(0); // dummy clocks, whole bytes only
+	}
+}
+
+// Streaming reads. The fast read command is only sent on the first pull and
+// CS then stays asserted, so each flash_stream_read() just clocks out data.
+// Any other driver call parks the stream first (CS released, suspended
+// operation resumed) and the next pull re-issues the command where the
+// stream left off. Only one stream exists at a time, it stays on the device
+// that was selected when it was opened.
+static struct flash_dev_s * stream_dev;
+static uint32_t stream_addr, stream_end;
+static uint8_t stream_open = 0;
+static uint8_t stream_active = 0;	// CS asserted, command sent
+static uint8_t stream_resume = 0;	// busy state to resume when parked
+
+static void flash_stream_park()
+{
+	if (!stream_active) return;
+
+	CSRELEASE();
+	SPI_end();
+	stream_active = 0;
+	flash_resume(stream_resume, flash_dev->flags);
 }
 
-void flash_erase_block(uint32_t addr)
+void flash_stream_open(uint32_t addr, size_t len)
+{
+	flash_read_wait();
+	stream_dev = flash_dev;
+	stream_addr = addr;
+	stream_end = addr + len;
+	stream_open = 1;
+}
+
+size_t flash_stream_read(void * buf, size_t len)
+{
+	struct flash_dev_s *prev;
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t n, left, start, t, a;
+	uint8_t irq, f;
+
+	if (!stream_open) return 0;
+	if (len > stream_end - stream_addr) len = stream_end - stream_addr;
+	prev = flash_select(stream_dev);
+	f = flash_dev->flags;
+
+	start = SysTick->CNT;
+	for (left = len; left > 0; left -= n) {
+		n = left;
+		// a read can't run across the die boundary on multi-die parts
+		if ((f & FLAG_MULTI_DIE) && n > 0x2000000 - (stream_addr & 0x1FFFFFF)) {
+			n = 0x2000000 - (stream_addr & 0x1FFFFFF);
+		}
+		t = SysTick->CNT;
+		a = stream_addr;
+		if (!stream_active) {
+			flash_read_wait();
+			stream_resume = flash_suspend(f, stream_addr, stream_end - stream_addr);
+			if (stream_resume == SUSPEND_FAILED) {
+				// chip stuck busy, the stream ends here
+				stream_resume = 0;
+				len -= left;
+				break;
+			}
+			flash_fast_cmd(stream_addr, f);
+			stream_active = 1;
+		}
+		stream_addr += n;
+
+		irq = __isenabled_irq();
+		__disable_irq();
+		SPI_write_8(0);
+		for (uint32_t i = n; --i; ) {
+			SPI_wait_TX_complete();
+			SPI_write_8(0);
+			SPI_wait_RX_available();
+			*p++ = SPI_read_8();
+		}
+		SPI_wait_RX_available();
+		*p++ = SPI_read_8();
+		if (irq) __enable_irq();
+		flash_trace(flash_dev->geom.read_op, a, n, t);
+
+		if ((f & FLAG_MULTI_DIE) && !(stream_addr & 0x1FFFFFF)) {
+			flash_stream_park();
+		}
+	}
+	flash_stats.read_bytes += len;
+	flash_stats.read_ticks += SysTick->CNT - start;
+	flash_select(prev);
+
+	return len;
+}
+
+void flash_stream_close()
+{
+	flash_stream_park();
+	stream_open = 0;
+}
+
+#if FLASH_USE_DMA
+// SPI1_RX is hard-wired to DMA1 channel 2 and SPI1_TX to channel 3.
+// The TX channel keeps clocking out the same dummy byte while the RX
+// channel streams DATAR into the destination buffer.
+static uint8_t dma_dummy = 0;
+static uint8_t dma_active = 0;	// DMA read in flight, CS still asserted
+static uint8_t dma_resume = 0;	// busy state to resume once it's done
+static uint32_t dma_addr, dma_len, dma_start;	// for the trace
+
+static void flash_dma_start(uint8_t * p, uint16_t len)
+{
+	DMA1->INTFCR = DMA1_Channel2_IT_Mask | DMA1_Channel3_IT_Mask;
+
+	DMA1_Channel2->PADDR = (uint32_t)&SPI1->DATAR;
+	DMA1_Channel2->MADDR = (uint32_t)p;
+	DMA1_Channel2->CNTR = len;
+	// RX must win arbitration, or the next frame overruns DATAR
+	DMA1_Channel2->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_PL | DMA_CFGR1_EN;
+
+	DMA1_Channel3->PADDR = (uint32_t)&SPI1->DATAR;
+	DMA1_Channel3->MADDR = (uint32_t)&dma_dummy;
+	DMA1_Channel3->CNTR = len;
+	DMA1_Channel3->CFGR = DMA_CFGR1_DIR | DMA_CFGR1_EN;
+
+	// TXE is already set, so this kicks off the transfer
+	SPI1->CTLR2 |= SPI_CTLR2_RXDMAEN | SPI_CTLR2_TXDMAEN;
+}
+
+static void flash_dma_stop()
+{
+	while (!(DMA1->INTFR & DMA_TCIF2));
+
+	SPI1->CTLR2 &= ~(SPI_CTLR2_RXDMAEN | SPI_CTLR2_TXDMAEN);
+	DMA1_Channel2->CFGR = 0;
+	DMA1_Channel3->CFGR = 0;
+	DMA1->INTFCR = DMA1_Channel2_IT_Mask | DMA1_Channel3_IT_Mask;
+}
+
+// CS asserted, SPI in 8 bit mode, read command + address sent
+static void flash_dma_cmd(uint32_t addr, uint8_t f)
 {
-	uint8_t f = flags;
-	if (busy) flash_wait();
 	SPI_begin_8();
 	CSASSERT();
-	SPI_transfer_8(0x06); // write enable command
+	SPI_transfer_8(0x03);
+	if (f & FLAG_32BIT_ADDR) {
+		SPI_transfer_8(addr >> 24);
+	}
+	SPI_transfer_8(addr >> 16);
+	SPI_transfer_8(addr >> 8);
+	SPI_transfer_8(addr);
+}
+
+static void flash_dma_read(uint32_t addr, uint8_t * p, uint32_t len, uint8_t f)
+{
+	uint32_t start = SysTick->CNT;
+
+	flash_dma_cmd(addr, f);
+	for (uint32_t left = len; left > 0; ) {
+		// CNTR is 16 bit wide, keep CS asserted and re-arm
+		uint16_t n = (left > 0xFFFF) ? 0xFFFF : left;
+		flash_dma_start(p, n);
+		flash_dma_stop();
+		p += n;
+		left -= n;
+	}
 	CSRELEASE();
-	Delay_Us(1);
+	SPI_end();
+	flash_trace(0x03, addr, len, start);
+}
+
+bool flash_read_done()
+{
+	if (!dma_active) return true;
+	if (!(DMA1->INTFR & DMA_TCIF2)) return false;
+
+	flash_dma_stop();
+	CSRELEASE();
+	SPI_end();
+	flash_trace(0x03, dma_addr, dma_len, dma_start);
+	dma_active = 0;
+	flash_resume(dma_resume, flash_dev->flags);
+
+	return true;
+}
+
+void flash_read_wait()
+{
+	flash_stream_park();
+	while (!flash_read_done());
+	flash_wake();
+}
+
+void flash_read_async(uint32_t addr, void * buf, size_t len)
+{
+	uint8_t f = flash_dev->flags;
+
+	flash_read_wait();
+	if (read_mode != FLASH_READ_DMA || len < FLASH_DMA_MIN_LEN || len > 0xFFFF ||
+		((f & FLAG_MULTI_DIE) && ((addr & 0xFE000000) != ((addr + len - 1) & 0xFE000000)))) {
+		flash_read(addr, buf, len);
+		return;
+	}
+	dma_resume = flash_suspend(f, addr, len);
+	if (dma_resume == SUSPEND_FAILED) {
+		dma_resume = 0;
+		memset(buf, 0xFF, len);
+		return;
+	}
+	dma_addr = addr;
+	dma_len = len;
+	dma_start = SysTick->CNT;
+	flash_dma_cmd(addr, f);
+	flash_dma_start((uint8_t *)buf, len);
+	dma_active = 1;
+}
+#else
+bool flash_read_done()
+{
+	return true;
+}
+
+void flash_read_wait()
+{
+	flash_stream_park();
+	flash_wake();
+}
+
+void flash_read_async(uint32_t addr, void * buf, size_t len)
+{
+	flash_read(addr, buf, len);
+}
+#endif // FLASH_USE_DMA
 
+// Plain 0x03 read, one halfword in flight at a time
+static void flash_read_normal(uint32_t addr, uint8_t * p, uint32_t len, uint8_t f)
+{
+	uint32_t start = SysTick->CNT;
+
+    SPI_begin_16();
 	CSASSERT();
 	if (f & FLAG_32BIT_ADDR) {
-		SPI_transfer_8(0x52);
+		SPI_transfer_8(0x03);
 		SPI_transfer_16(addr >> 16);
 		SPI_transfer_16(addr);
 	} else {
-		SPI_transfer_8(0x52);
-		SPI_transfer_8(((addr >> 16) & 0xff));
-		SPI_transfer_8((addr >> 8) & 0xff);
-		SPI_transfer_8(addr & 0xff);
+		SPI_transfer_16(0x0300 | ((addr >> 16) & 255));
+		SPI_transfer_16(addr);
+	}
+	for (int i = 0; i < len; i+=2)
+	{
+		uint16_t data = SPI_transfer_16(0);
+		p[i] = data >> 8;
+
+		if (i + 1 < len)
+		{
+	    	p[i + 1] = data & 0xff;
+		}
+	}
+	CSRELEASE();
+	SPI_end();
+	flash_trace(0x03, addr, len, start);
+}
+
+// FAST_READ (0x0B). Command, address and dummy byte go out in 8 bit frames,
+// then the data phase switches to 16 bit frames and writes the next frame as
+// soon as TXE says the previous one reached the shift register, so SCK runs
+// back-to-back. Interrupts are held off while the pipeline runs: a missed
+// RXNE would overrun DATAR and leave us waiting for a frame that never comes.
+static void flash_read_fast(uint32_t addr, uint8_t * p, uint32_t len, uint8_t f)
+{
+	uint32_t words = len >> 1, start = SysTick->CNT;
+	uint8_t irq;
+	uint16_t data;
+
+	flash_fast_cmd(addr, f);
+	// DFF can only change while SPE is off, CS stays asserted
+	SPI_end();
+	SPI_begin_16();
+
+	if (words) {
+		irq = __isenabled_irq();
+		__disable_irq();
+		SPI_write_16(0);
+		while (--words) {
+			SPI_wait_TX_complete();
+			SPI_write_16(0);
+			SPI_wait_RX_available();
+			data = SPI_read_16();
+			*p++ = data >> 8;
+			*p++ = data;
+		}
+		SPI_wait_RX_available();
+		data = SPI_read_16();
+		*p++ = data >> 8;
+		*p++ = data;
+		if (irq) __enable_irq();
+	}
+	if (len & 1) {
+		*p = SPI_transfer_16(0) >> 8;
+	}
+	CSRELEASE();
+	SPI_end();
+	flash_trace(flash_dev->geom.read_op, addr, len, start);
+}
+
+void flash_set_read_mode(uint8_t mode)
+{
+	if (mode > FLASH_READ_DMA) return;
+	flash_read_wait();
+	read_mode = mode;
+	flash_stats.read_bytes = 0;
+	flash_stats.read_ticks = 0;
+}
+
+uint8_t flash_get_read_mode()
+{
+	return read_mode;
+}
+
+// False if the chip was stuck busy, buf is all 0xFF then
+static bool flash_read_raw(uint32_t addr, void * buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	uint8_t b, f;
+	uint32_t start;
+
+	flash_read_wait();
+	start = SysTick->CNT;
+	f = flash_dev->flags;
+	b = flash_suspend(f, addr, len);
+	if (b == SUSPEND_FAILED) {
+		// hand back erased bytes rather than status
+		memset(p, 0xFF, len);
+		return false;
+	}
+	flash_stats.read_bytes += len;
+	do {
+		uint32_t rdlen = len;
+		if (f & FLAG_MULTI_DIE) {
+			if ((addr & 0xFE000000) != ((addr + len - 1) & 0xFE000000)) {
+				rdlen = 0x2000000 - (addr & 0x1FFFFFF);
+			}
+		}
+		switch (read_mode) {
+#if FLASH_USE_DMA
+		case FLASH_READ_DMA:
+			if (rdlen >= FLASH_DMA_MIN_LEN) {
+				flash_dma_read(addr, p, rdlen, f);
+				break;
+			}
+			// fall through
+#endif
+		case FLASH_READ_FAST:
+			flash_read_fast(addr, p, rdlen, f);
+			break;
+		default:
+			flash_read_normal(addr, p, rdlen, f);
+			break;
+		}
+		p += rdlen;
+		addr += rdlen;
+		len -= rdlen;
+	} while (len > 0);
+	flash_resume(b, f);
+	flash_stats.read_ticks += SysTick->CNT - start;
+
+	return true;
+}
+
+#if FLASH_CACHE_LINES
+// Tiny read cache for the small records that get read over and over
+// (challenge status, ext commands). Line tags are line aligned addresses,
+// so an all-ones tag can never match, plus the device the line came from.
+#define FLASH_CACHE_INVALID 0xFFFFFFFF
+
+struct flash_line_s
+{
+    uint32_t tag;
+    struct flash_dev_s * dev;
+    uint8_t age;
+    uint8_t ahead;	// read ahead, not used yet
+    uint8_t data[FLASH_CACHE_LINE_SIZE];
+};
+
+static struct flash_line_s cache[FLASH_CACHE_LINES] = {
+    [0 ... FLASH_CACHE_LINES - 1] = { .tag = FLASH_CACHE_INVALID },
+};
+
+// Where the last flash_read() ended, and how many reads in a row started
+// right where the one before ended. One such read is common enough (a
+// header, then the key behind it), a run of them is a reader walking
+// through flash and worth reading ahead for.
+#define FLASH_PREFETCH_RUN 2
+
+static uint32_t seq_next = FLASH_CACHE_INVALID;
+static struct flash_dev_s * seq_dev;
+static uint8_t seq_run;
+
+static struct flash_line_s * flash_cache_find(uint32_t base)
+{
+	for (int i = 0; i < FLASH_CACHE_LINES; i++) {
+		if (cache[i].tag == base && cache[i].dev == flash_dev) return &cache[i];
+	}
+
+	return NULL;
+}
+
+// Oldest line other than keep, invalid lines are always the oldest
+static struct flash_line_s * flash_cache_victim(struct flash_line_s * keep)
+{
+	struct flash_line_s *l, *victim = (keep == cache) ? cache + 1 : cache;
+
+	for (l = cache; l < cache + FLASH_CACHE_LINES; l++) {
+		if (l == keep) continue;
+		if (l->tag == FLASH_CACHE_INVALID) return l;
+		if (l->age > victim->age) victim = l;
+	}
+
+	return victim;
+}
+
+static void flash_cache_fill(struct flash_line_s * l, uint32_t base, const uint8_t * data, uint8_t ahead)
+{
+	memcpy(l->data, data, FLASH_CACHE_LINE_SIZE);
+	l->tag = base;
+	l->dev = flash_dev;
+	l->ahead = ahead;
+}
+
+static struct flash_line_s * flash_cache_line(uint32_t base, bool seq)
+{
+	struct flash_line_s *l, *victim = flash_cache_find(base);
+	uint8_t tmp[FLASH_CACHE_LINE_SIZE * 2];
+	bool ok;
+
+	if (victim) {
+		flash_stats.cache_hits++;
+#if FLASH_PREFETCH
+		if (victim->ahead) {
+			flash_stats.prefetch_hits++;
+			victim->ahead = 0;
+		}
+#endif
+	} else {
+		flash_stats.cache_misses++;
+		victim = flash_cache_victim(NULL);
+		victim->tag = FLASH_CACHE_INVALID;
+#if FLASH_PREFETCH
+		// the reader is walking forward, bring the next line along
+		if (seq && !flash_cache_find(base + FLASH_CACHE_LINE_SIZE)) {
+			struct flash_line_s *next = flash_cache_victim(victim);
+
+			next->tag = FLASH_CACHE_INVALID;
+			ok = flash_read_raw(base, tmp, sizeof(tmp));
+			if (ok) {
+				flash_cache_fill(next, base + FLASH_CACHE_LINE_SIZE, tmp + FLASH_CACHE_LINE_SIZE, 1);
+				next->age = 0;
+				flash_stats.prefetches++;
+			}
+		} else
+#endif
+		{
+			ok = flash_read_raw(base, tmp, FLASH_CACHE_LINE_SIZE);
+		}
+		flash_cache_fill(victim, base, tmp, 0);
+		// the caller gets the 0xFF bytes once, the next read tries again
+		if (!ok) victim->tag = FLASH_CACHE_INVALID;
+	}
+
+	for (l = cache; l < cache + FLASH_CACHE_LINES; l++) {
+		if (l->age < 0xFF) l->age++;
+	}
+	victim->age = 0;
+
+	return victim;
+}
+
+static void flash_cache_read(uint32_t addr, uint8_t * p, size_t len, bool seq)
+{
+	struct flash_line_s *l;
+	uint32_t base, off, n;
+
+	while (len) {
+		base = addr & ~(FLASH_CACHE_LINE_SIZE - 1);
+		off = addr - base;
+		n = FLASH_CACHE_LINE_SIZE - off;
+		if (n > len) n = len;
+
+		l = flash_cache_line(base, seq);
+		memcpy(p, l->data + off, n);
+
+		p += n;
+		addr += n;
+		len -= n;
+	}
+}
+#endif // FLASH_CACHE_LINES
+
+// Drop every cached line of the selected device overlapping [addr, addr + len)
+void flash_cache_invalidate(uint32_t addr, uint32_t len)
+{
+#if FLASH_CACHE_LINES
+	for (int i = 0; i < FLASH_CACHE_LINES; i++) {
+		if (cache[i].tag != FLASH_CACHE_INVALID &&
+			cache[i].dev == flash_dev &&
+			cache[i].tag < addr + len &&
+			cache[i].tag + FLASH_CACHE_LINE_SIZE > addr) {
+			cache[i].tag = FLASH_CACHE_INVALID;
+		}
+	}
+#endif
+}
+
+void flash_read(uint32_t addr, void * buf, size_t len)
+{
+#if FLASH_CACHE_LINES
+	if (addr == seq_next && flash_dev == seq_dev) {
+		if (seq_run < 0xFF) seq_run++;
+	} else {
+		seq_run = 0;
+	}
+	seq_next = addr + len;
+	seq_dev = flash_dev;
+
+	if (len <= FLASH_CACHE_MAX_READ) {
+		flash_read_wait();
+		flash_cache_read(addr, (uint8_t *)buf, len, seq_run >= FLASH_PREFETCH_RUN);
+	} else {
+		flash_read_raw(addr, buf, len);
+	}
+#else
+	flash_read_raw(addr, buf, len);
+#endif
+}
+
+// CRC-32 (IEEE 802.3, as zlib/crc32 tools print it), a nibble at a time
+// so the table stays at 64 bytes
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t flash_crc32(uint32_t addr, uint32_t len)
+{
+	uint8_t chunk[32];
+	uint32_t crc = 0xFFFFFFFF;
+	size_t n;
+
+	flash_stream_open(addr, len);
+	while ((n = flash_stream_read(chunk, sizeof(chunk))) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			crc ^= chunk[i];
+			crc = (crc >> 4) ^ crc32_nibble[crc & 15];
+			crc = (crc >> 4) ^ crc32_nibble[crc & 15];
+		}
+	}
+	flash_stream_close();
+
+	return ~crc;
+}
+
+// Bytes per second out of a SysTick interval, without 64 bit math
+static uint32_t flash_rate(uint32_t bytes, uint32_t ticks)
+{
+	uint32_t us = ticks / DELAY_US_TIME;
+
+	if (!us) return 0;
+	if (bytes < 4000000) return bytes * 1000 / us * 1000;
+	return bytes / (us / 1000 + 1) * 1000;
+}
+
+// The read line stays here, the rest is rarely looked at and lives in the
+// stats overlay
+void flash_print_stats()
+{
+	struct overlay_stats_s s = {
+		.stats = &flash_stats,
+		.wake_us = flash_stats.wakes ? flash_stats.wake_ticks / flash_stats.wakes / DELAY_US_TIME : 0,
+#if FLASH_PREFETCH
+		.prefetch_pct = flash_stats.prefetches ? flash_stats.prefetch_hits * 100 / flash_stats.prefetches : 0,
+#endif
+		.clk_div = 2 << flash_dev->br,
+	};
+
+	printf("Read mode %d: %lu bytes in %lu ticks (%lu B/s)\r\n",
+		read_mode,
+		flash_stats.read_bytes,
+		flash_stats.read_ticks,
+		flash_rate(flash_stats.read_bytes, flash_stats.read_ticks));
+
+	if (overlay_call(OVERLAY_STATS, &s) == OVERLAY_MISSING) {
+		printf("More with the stats overlay, see src/tool/pack_overlays.py\r\n");
 	}
+}
+
+uint8_t flash_read_status(uint8_t cmd)
+{
+	uint8_t status;
+	uint32_t start;
+
+	flash_read_wait();
+	start = SysTick->CNT;
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(cmd);
+	status = SPI_transfer_8(0);
 	CSRELEASE();
 	SPI_end();
-	busy = 2;
+	flash_trace(cmd, 0, 1, start);
+
+	return status;
 }
 
+void flash_read_status_registers()
+{
+    int status;
+    // SPI_begin_8();
+    CSASSERT();
+    SPI_transfer_8(0x05);
+    status = SPI_transfer_8(0);
+    printf("Status register 1 = 0x%x\r\n", status);
+    CSRELEASE();
+	// SPI_end();
+
+    // SPI_begin_8();
+    CSASSERT();
+    SPI_transfer_8(0x35);
+    status = SPI_transfer_8(0);
+    printf("Status register 2 = 0x%x\r\n", status);
+    CSRELEASE();
+	// SPI_end();
+
+    // SPI_begin_8();
+    CSASSERT();
+    SPI_transfer_8(0x15);
+    status = SPI_transfer_8(0);
+    printf("Status register 3 = 0x%x\r\n", status);
+    CSRELEASE();
+	// SPI_end();
+}
+
+bool flash_erase_block_ext(uint32_t addr)
+{
+	uint32_t start;
+
+	flash_job_sync();
+	if (!flash_idle()) return false;
+	start = SysTick->CNT;
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(0x06); // write enable command
+	CSRELEASE();
+	Delay_Us(1);
+
+	// the opcodes come from flash, they may well hit the main array
+	flash_cache_invalidate(0, 0xFFFFFFFF);
+	CSASSERT();
+	SPI_transfer_8(flash_ext_cmds.erase); // 0x44
+	SPI_transfer_8(((addr >> 16) & 0xff));
+	SPI_transfer_8((addr >> 8) & 0xff);
+	SPI_transfer_8(addr & 0xff);
+	CSRELEASE();
+	SPI_end();
+	flash_trace(flash_ext_cmds.erase, addr, 0, start);
+	flash_busy_set(BUSY_OTHER, FLASH_TSE_US, 0, 0);
+
+	return true;
+}
+
+void flash_read_ext(uint32_t addr, void * buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+	uint8_t b;
+	uint32_t start;
+
+	flash_read_wait();
+	b = flash_suspend(flash_dev->flags, 0, 0); // security registers, not the array
+	if (b == SUSPEND_FAILED) {
+		memset(p, 0xFF, len);
+		return;
+	}
+	start = SysTick->CNT;
+
+	if (len > 256) memset(p + 256, 0, len - 256);
+    SPI_begin_8();
+	len = MIN(len, 256);
+	CSASSERT();
+	SPI_transfer_8(flash_ext_cmds.read); // 0x48
+	SPI_transfer_8(((addr >> 16) & 0xff));
+	SPI_transfer_8((addr >> 8) & 0xff);
+	SPI_transfer_8(addr & 0xff);
+
+	// Write a dummy byte
+	SPI_transfer_8(0);
+
+#if FLASH_USE_DMA
+	if (len >= FLASH_DMA_MIN_LEN) {
+		flash_dma_start(p, len);
+		flash_dma_stop();
+	} else
+#endif
+	for (int i = 0; i < len; i++)
+	{
+	    p[i] = SPI_transfer_8(0);
+	}
+	CSRELEASE();
+	SPI_end();
+	flash_trace(flash_ext_cmds.read, addr, len, start);
+	flash_resume(b, flash_dev->flags);
+}
+
+bool flash_write_ext(uint32_t addr, void * buf, size_t len)
+{
+
+	const uint8_t *p = (const uint8_t *)buf;
+	uint32_t n, start;
+
+	len = MIN(len, 256);
+
+	flash_job_sync();
+	if (!flash_idle()) return false;
+	start = SysTick->CNT;
+	SPI_begin_8();
+	CSASSERT();
+	// write enable command
+	SPI_transfer_8(0x06);
+	CSRELEASE();
+
+	Delay_Us(1);
+	flash_cache_invalidate(0, 0xFFFFFFFF);
+	CSASSERT();
+	SPI_transfer_8(flash_ext_cmds.write); // 0x42
+	SPI_transfer_8(((addr >> 16) & 0xff));
+	SPI_transfer_8((addr >> 8) & 0xff);
+	SPI_transfer_8(addr & 0xff);
+
+	n = len;
+	do {
+		SPI_transfer_8(*p++);
+	} while (--n > 0);
+	CSRELEASE();
+	flash_busy_set(BUSY_OTHER, FLASH_TPP_US, 0, 0);
+	SPI_end();
+	flash_trace(flash_ext_cmds.write, addr, len, start);
+
+	return true;
+}
+
+// Issue one page program, never crossing a page boundary.
+// Returns the number of bytes sent, the chip is left busy.
+static uint32_t flash_program_page(uint32_t addr, const uint8_t * p, uint32_t len)
+{
+	uint32_t max, pagelen, n, start = SysTick->CNT;
+
+	SPI_begin_8();
+	CSASSERT();
+	// write enable command
+	SPI_transfer_8(0x06);
+	CSRELEASE();
+
+	max = 256 - (addr & 0xFF);
+	pagelen = (len <= max) ? len : max;
+	Delay_Us(1); // TODO: reduce this, but prefer safety first
+	CSASSERT();
+	if (flash_dev->flags & FLAG_32BIT_ADDR) {
+		SPI_transfer_8(0x02); // program page command
+		SPI_transfer_8(addr >> 24);
+	} else {
+		SPI_transfer_8(0x02);
+	}
+	SPI_transfer_8(((addr >> 16) & 0xff));
+	SPI_transfer_8((addr >> 8) & 0xff);
+	SPI_transfer_8(addr & 0xff);
+	flash_cache_invalidate(addr, pagelen);
+	n = pagelen;
+	do {
+		SPI_transfer_8(*p++);
+	} while (--n > 0);
+	CSRELEASE();
+	flash_busy_set(BUSY_PROGRAM, FLASH_TPP_US, addr, pagelen);
+	SPI_end();
+	flash_trace(0x02, addr, pagelen, start);
+
+	return pagelen;
+}
+
+static void flash_erase_issue(uint32_t addr, uint8_t op, uint8_t shift)
+{
+	uint32_t bsize = 1ul << shift, start = SysTick->CNT;
+
+	addr &= ~(bsize - 1);
+	flash_cache_invalidate(addr, bsize);
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(0x06); // write enable command
+	CSRELEASE();
+	Delay_Us(1);
+
+	CSASSERT();
+	SPI_transfer_8(op);
+	if (flash_dev->flags & FLAG_32BIT_ADDR) {
+		SPI_transfer_8(addr >> 24);
+	}
+	SPI_transfer_8(((addr >> 16) & 0xff));
+	SPI_transfer_8((addr >> 8) & 0xff);
+	SPI_transfer_8(addr & 0xff);
+	CSRELEASE();
+	SPI_end();
+	flash_trace(op, addr, bsize, start);
+	flash_busy_set(BUSY_ERASE, (shift <= 12) ? FLASH_TSE_US : (shift <= 15) ? FLASH_TBE1_US : FLASH_TBE2_US,
+		addr, bsize);
+}
+
+bool flash_write(uint32_t addr, void * buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint32_t pagelen;
+
+	flash_job_sync();
+	do {
+		if (!flash_idle()) return false;
+		pagelen = flash_program_page(addr, p, len);
+		addr += pagelen;
+		p += pagelen;
+		len -= pagelen;
+	} while (len > 0);
+
+	return true;
+}
+
+bool flash_erase_block(uint32_t addr)
+{
+	struct flash_geom_s *g = &flash_dev->geom;
+
+	if (!g->block_op) return false;
+
+	flash_job_sync();
+	addr &= ~((1ul << FLASH_BLOCK_SHIFT) - 1);
+	for (uint32_t n = 1ul << (FLASH_BLOCK_SHIFT - g->block_shift); n; n--) {
+		if (!flash_idle()) return false;
+		flash_erase_issue(addr, g->block_op, g->block_shift);
+		addr += 1ul << g->block_shift;
+	}
+
+	return true;
+}
+
+static void flash_erase_chip()
+{
+	uint32_t start = SysTick->CNT;
+
+	flash_cache_invalidate(0, 0xFFFFFFFF);
+	SPI_begin_8();
+	CSASSERT();
+	SPI_transfer_8(0x06); // write enable command
+	CSRELEASE();
+	Delay_Us(1);
+
+	CSASSERT();
+	SPI_transfer_8(0xC7);
+	CSRELEASE();
+	SPI_end();
+	flash_trace(0xC7, 0, 0, start);
+	flash_busy_set(BUSY_OTHER, 0, 0, flash_dev->geom.size);
+}
+
+bool flash_erase_range(uint32_t addr, uint32_t len)
+{
+	struct flash_geom_s *g = &flash_dev->geom;
+	uint32_t end, size;
+	uint8_t i, op, shift, min;
+
+	if (!len) return true;
+
+	flash_job_sync();
+	if (!flash_idle()) return false;
+
+	if (addr == 0 && len >= g->size) {
+		flash_erase_chip();
+		return true;
+	}
+
+	// round out to the smallest erase granularity
+	min = 31;
+	for (i = 0; i < 4; i++) {
+		if (g->erase_op[i] && g->erase_shift[i] < min) min = g->erase_shift[i];
+	}
+	end = addr + len;
+	addr &= ~((1ul << min) - 1);
+
+	// greedy: the biggest erase that's aligned here and doesn't overshoot
+	while (addr < end) {
+		op = 0;
+		shift = min;
+		for (i = 0; i < 4; i++) {
+			if (!g->erase_op[i] || g->erase_shift[i] < shift) continue;
+			size = 1ul << g->erase_shift[i];
+			if ((addr & (size - 1)) || (end - addr < size && g->erase_shift[i] > min)) continue;
+			op = g->erase_op[i];
+			shift = g->erase_shift[i];
+		}
+		if (!flash_idle()) return false;
+		flash_erase_issue(addr, op, shift);
+		addr += 1ul << shift;
+		if (!addr) break; // wrapped at the top of the address space
+	}
+
+	return true;
+}
+
+// NOR programming can only clear bits. Compare the target range with the
+// new data: identical, reachable by programming alone, or needs an erase.
+static uint8_t flash_update_check(uint32_t addr, const uint8_t * p, size_t len)
+{
+	uint8_t chunk[32];
+	uint8_t r = FLASH_UPDATE_SAME;
+	uint32_t i, n;
+
+	while (len) {
+		n = (len < sizeof(chunk)) ? len : sizeof(chunk);
+		// straight from the chip, a compare pass shouldn't evict hot lines
+		flash_read_raw(addr, chunk, n);
+		for (i = 0; i < n; i++) {
+			if (chunk[i] == p[i]) continue;
+			if ((chunk[i] & p[i]) != p[i]) return FLASH_UPDATE_ERASE;
+			r = FLASH_UPDATE_PROGRAM;
+		}
+		p += n;
+		addr += n;
+		len -= n;
+	}
+
+	return r;
+}
+
+uint8_t flash_update(uint32_t addr, const void * buf, size_t len)
+{
+	uint8_t r;
+
+	flash_job_sync();
+	r = flash_update_check(addr, (const uint8_t *)buf, len);
+
+	switch (r) {
+	case FLASH_UPDATE_SAME:
+		flash_stats.programs_avoided++;
+		flash_stats.erases_avoided++;
+		break;
+	case FLASH_UPDATE_PROGRAM:
+		flash_stats.erases_avoided++;
+		if (!flash_write(addr, (void *)buf, len)) r = FLASH_UPDATE_FAILED;
+		break;
+	default:
+		if (!flash_erase_range(addr, len) || !flash_write(addr, (void *)buf, len)) r = FLASH_UPDATE_FAILED;
+		break;
+	}
+
+	return r;
+}
+
+#if FLASH_CALIBRATE
+#define FLASH_CAL_LEN		256
+#define FLASH_CAL_SLOWEST	7	// HCLK/256
+
+// Alternating bits, then a counter with every bit flipped
+static uint8_t flash_cal_byte(uint32_t i)
+{
+	if (i < FLASH_CAL_LEN / 2) return (i & 1) ? 0x55 : 0xAA;
+	return ~i;
+}
+
+// The ID and the pattern, FLASH_CAL_PASSES times at the current clock.
+// Reads bypass the cache, and go through whichever read engine is
+// selected.
+static bool flash_cal_pass(const uint8_t * ref)
+{
+	uint8_t id[5], chunk[32];
+	uint32_t i, j;
+
+	for (uint8_t pass = 0; pass < FLASH_CAL_PASSES; pass++) {
+		flash_read_id(id);
+		if (memcmp(id, ref, 3)) return false;
+		for (i = 0; i < FLASH_CAL_LEN; i += sizeof(chunk)) {
+			flash_read_raw(FLASH_CAL_ADDR + i, chunk, sizeof(chunk));
+			for (j = 0; j < sizeof(chunk); j++) {
+				if (chunk[j] != flash_cal_byte(i + j)) return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+uint8_t flash_calibrate()
+{
+	uint8_t ref[5], chunk[32];
+	uint8_t br, best;
+	uint32_t i, j;
+
+	// flash_wake() applies the prescaler on every call
+	flash_dev->br = FLASH_CAL_SLOWEST;
+	flash_read_id(ref);
+
+	// the pattern goes in at the slowest clock, once per chip
+	for (i = 0; i < FLASH_CAL_LEN; i += sizeof(chunk)) {
+		for (j = 0; j < sizeof(chunk); j++) {
+			chunk[j] = flash_cal_byte(i + j);
+		}
+		flash_update(FLASH_CAL_ADDR + i, chunk, sizeof(chunk));
+	}
+
+	best = FLASH_CAL_SLOWEST;
+	for (br = FLASH_CAL_SLOWEST; ; br--) {
+		flash_dev->br = br;
+		if (!flash_cal_pass(ref)) {
+			// best only just made it, leave it some margin
+			if (best < FLASH_CAL_SLOWEST) best++;
+			break;
+		}
+		best = br;
+		if (!br) break;
+	}
+	flash_dev->br = best;
+	flash_spi_clock();
+	// anything cached so far was read at the untested default clock
+	flash_cache_invalidate(0, 0xFFFFFFFF);
+
+	return best;
+}
+#endif // FLASH_CALIBRATE
+
+// Background erase/program queue. Jobs are started and retired from
+// flash_job_poll(), which only ever does a single status probe per device
+// when the chip is still busy, so the caller's loop keeps running. Jobs run
+// in order on their own device, but each device works through its jobs
+// independently: an erase on one chip doesn't hold up programs on another.
+// Slots retired out of order stay taken until everything before them is
+// done too, which keeps handles sequential.
+struct flash_job_s
+{
+    uint8_t type;               // 0 once retired
+    uint16_t len;               // bytes left to program/erase
+    uint32_t addr;
+    const uint8_t * buf;
+    struct flash_dev_s * dev;
+    flash_job_cb done;
+};
+
+static struct flash_job_s jobs[FLASH_JOB_SLOTS];
+static uint8_t job_head = 0;
+static uint8_t job_count = 0;
+static uint8_t job_seq = 0;		// handle of the job at job_head
+static uint8_t job_in_cb = 0;
+
+#define JOB(i)	(&jobs[(job_head + (i)) % FLASH_JOB_SLOTS])
+
+static int flash_job_add(uint8_t type, uint32_t addr, const void * buf, size_t len, flash_job_cb done)
+{
+	struct flash_job_s *j;
+
+	while (job_count == FLASH_JOB_SLOTS) {
+		// can't drain the queue from inside one of its own callbacks, or
+		// while a CLI session holds the bus
+		if (job_in_cb || (SPI1->CTLR1 & SPI_CTLR1_SPE)) return -1;
+		flash_job_poll();
+	}
+
+	j = JOB(job_count);
+	j->type = type;
+	j->addr = addr;
+	j->buf = (const uint8_t *)buf;
+	j->len = len;
+	j->dev = flash_dev;
+	j->done = done;
+
+	return (uint8_t)(job_seq + job_count++);
+}
+
+int flash_job_erase(uint32_t addr, flash_job_cb done)
+{
+	if (!flash_dev->geom.block_op) return -1;
+
+	addr &= ~((1ul << FLASH_BLOCK_SHIFT) - 1);
+	return flash_job_add(FLASH_JOB_ERASE, addr, NULL, 1ul << FLASH_BLOCK_SHIFT, done);
+}
+
+int flash_job_program(uint32_t addr, const void * buf, size_t len, flash_job_cb done)
+{
+	return flash_job_add(FLASH_JOB_PROGRAM, addr, buf, len, done);
+}
+
+int flash_job_call(flash_job_cb fn)
+{
+	return flash_job_add(FLASH_JOB_CALL, 0, NULL, 0, fn);
+}
+
+uint8_t flash_job_free()
+{
+	if (SPI1->CTLR1 & SPI_CTLR1_SPE) return 0;
+
+	return FLASH_JOB_SLOTS - job_count;
+}
+
+bool flash_job_done(int handle)
+{
+	uint8_t i = handle - job_seq;
+
+	return i >= job_count || !JOB(i)->type;
+}
+
+// Advance the selected device's oldest job by one step. Returns true if a
+// callback ran, the queue may look different after that.
+static bool flash_job_step(struct flash_job_s * j)
+{
+	flash_job_cb done;
+	uint8_t finished;
+	uint32_t n;
+
+	flash_wake();
+	if (flash_busy_poll()) return false;
+
+	switch (j->type) {
+	case FLASH_JOB_ERASE:
+	case FLASH_JOB_PROGRAM:
+		finished = (j->len == 0);
+		break;
+	default:
+		// FLASH_JOB_CALL, the chip is idle and everything before it is done
+		finished = 1;
+		break;
+	}
+
+	if (finished) {
+		done = j->done;
+		j->type = 0;
+		while (job_count && !jobs[job_head].type) {
+			job_head = (job_head + 1) % FLASH_JOB_SLOTS;
+			job_count--;
+			job_seq++;
+		}
+		if (done) {
+			job_in_cb++;
+			done();
+			job_in_cb--;
+			return true;
+		}
+		return false;
+	}
+
+	if (j->type == FLASH_JOB_ERASE) {
+		// one erase of the block's size, or the first of several smaller ones
+		n = 1ul << flash_dev->geom.block_shift;
+		flash_erase_issue(j->addr, flash_dev->geom.block_op, flash_dev->geom.block_shift);
+		j->addr += n;
+		j->len -= n;
+	} else {
+		n = flash_program_page(j->addr, j->buf, j->len);
+		j->addr += n;
+		j->buf += n;
+		j->len -= n;
+	}
+
+	return false;
+}
+
+// True if some job queued before position i has to finish before the job
+// at i may start: an earlier one on the same device, or a call on either
+// side, since a call waits for everything queued before it.
+static bool flash_job_blocked(uint8_t head, uint8_t i)
+{
+	struct flash_job_s *j = &jobs[(head + i) % FLASH_JOB_SLOTS];
+	struct flash_job_s *o;
+
+	while (i--) {
+		o = &jobs[(head + i) % FLASH_JOB_SLOTS];
+		if (!o->type) continue;
+		if (o->dev == j->dev || o->type == FLASH_JOB_CALL || j->type == FLASH_JOB_CALL) return true;
+	}
+
+	return false;
+}
+
+void flash_job_poll()
+{
+	struct flash_dev_s *prev = flash_dev, *d;
+	struct flash_job_s *j;
+	uint8_t head, i, n;
+
+	if (!flash_read_done()) return;
+	// a CLI BEGIN..END session (or an open stream) owns the bus
+	if (SPI1->CTLR1 & SPI_CTLR1_SPE) return;
+	if (!job_count) {
+		for (d = flash_devs; d; d = d->next) {
+			flash_dev_set(d);
+			flash_sleep_check();
+		}
+		flash_dev_set(prev);
+		return;
+	}
+
+	// Retiring a job clears its slot and moves job_head past empty slots
+	// but never moves a job, so this pass can work off a snapshot
+	head = job_head;
+	n = job_count;
+	for (i = 0; i < n; i++) {
+		j = &jobs[(head + i) % FLASH_JOB_SLOTS];
+		if (!j->type || flash_job_blocked(head, i)) continue;
+		flash_dev_set(j->dev);
+		if (flash_job_step(j)) break;
+	}
+	flash_dev_set(prev);
+}
+
+void flash_job_flush()
+{
+	while (job_count) flash_job_poll();
+}
+
+// Synchronous erase/program calls keep program order with the jobs queued
+// for the same device (and with calls). Callbacks run while their job is
+// retired, so they don't drain.
+static void flash_job_sync()
+{
+	uint8_t i;
+
+	flash_read_wait();
+	if (job_in_cb) return;
+	for (i = 0; i < job_count; ) {
+		struct flash_job_s *j = JOB(i);
+		if (j->type && (j->dev == flash_dev || j->type == FLASH_JOB_CALL)) {
+			flash_job_poll();
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+}
 
 void flash_load_ext_cmds()
 {
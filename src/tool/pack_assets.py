@@ -0,0 +1,192 @@
+#!/usr/bin/python
+
+# Packs the keys.h strings listed in src/include/asset.h into the LZSS blob
+# that asset_print() expands, and optionally writes it to the badge's SPI
+# flash over the CLI's raw SPI commands (BEGIN/ASSERT/DATA/RELEASE/END).
+
+from struct import pack
+import argparse
+import codecs
+import os
+import re
+import subprocess
+import zlib
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..")
+ASSET_H = os.path.join(ROOT, "src", "include", "asset.h")
+
+SERPORT = "/dev/ttyUSB0"
+MAGIC = 0x54455341
+WINDOW = 128
+MIN_MATCH = 3
+MAX_MATCH = MIN_MATCH + 255
+HDR_SIZE = 8
+ENTRY_SIZE = 8
+DATA_BYTES = 36     # hex bytes per DATA line, the CLI reads 128 chars
+
+def asset_list():
+    with open(ASSET_H) as f:
+        src = f.read()
+
+    assets = { int(i): (m, h or None) for i, m, h in
+        re.findall(r"#define ASSET_\w+[ \t]+(\d+)[ \t]+// (\w+)[ \t]*([\w.]*)", src) }
+    addr = int(re.search(r"#define ASSET_ADDR (0x[0-9A-Fa-f]+)", src).group(1), 16)
+
+    return [ assets[i] for i in range(len(assets)) ], addr
+
+def expand(macro, header, cc):
+    # Let the compiler do the macro expansion and string pasting
+    src = f"#include <aes.h>\n#include <{header}>\n__asset_begin {macro} __asset_end\n"
+    out = subprocess.run(cc.split() + [ "-E", "-P", "-x", "c", "-",
+        "-I" + os.path.join(ROOT, "src", "include"),
+        "-I" + os.path.join(ROOT, "ext", "tiny-aes-c") ],
+        input = src.encode(), capture_output = True, check = True).stdout.decode()
+    body = out[out.rindex("__asset_begin"):out.rindex("__asset_end")]
+
+    return b"".join(codecs.escape_decode(s.encode())[0] for s in re.findall(r'"((?:[^"\\]|\\.)*)"', body))
+
+def match_at(data, i):
+    best, dist = 0, 0
+    for j in range(max(0, i - WINDOW), i):
+        n = 0
+        while n < MAX_MATCH and i + n < len(data) and data[j + n] == data[i + n]:
+            n += 1
+        if n >= best:
+            best, dist = n, i - j
+
+    return best, dist
+
+def compress(data):
+    out = bytearray()
+    tokens = []
+    i = 0
+
+    while i < len(data):
+        n, dist = match_at(data, i)
+        # lazy: a literal here is cheaper if the next byte starts a longer match
+        if n >= MIN_MATCH and i + 1 < len(data) and match_at(data, i + 1)[0] > n + 1:
+            n = 0
+        if n >= MIN_MATCH:
+            tokens.append(bytes([ dist - 1, n - MIN_MATCH ]))
+            i += n
+        else:
+            tokens.append(data[i:i + 1])
+            i += 1
+
+    for k in range(0, len(tokens), 8):
+        group = tokens[k:k + 8]
+        out.append(sum(1 << b for b, t in enumerate(group) if len(t) == 1))
+        for t in group:
+            out += t
+
+    return bytes(out)
+
+def decompress(packed, size):
+    out = bytearray()
+    i = 0
+
+    while len(out) < size:
+        flags = packed[i]
+        i += 1
+        for b in range(8):
+            if len(out) >= size:
+                break
+            if flags & (1 << b):
+                out.append(packed[i])
+                i += 1
+            else:
+                dist, n = packed[i] + 1, packed[i + 1] + MIN_MATCH
+                i += 2
+                for _ in range(n):
+                    out.append(out[-dist])
+
+    return bytes(out[:size])
+
+def build(keys, cc):
+    macros, addr = asset_list()
+    streams = []
+
+    for m, header in macros:
+        data = expand(m, header or keys, cc)
+        packed = compress(data)
+        assert decompress(packed, len(data)) == data
+        assert len(data) < 0x10000
+        print(f"{m}: {len(data)} -> {len(packed)} bytes")
+        streams.append((data, packed))
+
+    blob = pack("<IHH", MAGIC, len(streams), 0)
+    offset = HDR_SIZE + ENTRY_SIZE * len(streams)
+    for data, packed in streams:
+        blob += pack("<IHH", offset, len(data), len(packed))
+        offset += len(packed)
+    for data, packed in streams:
+        blob += packed
+
+    return blob, addr
+
+class Badge:
+    def __init__(self, port):
+        import serial
+
+        self.ser = serial.Serial(port, baudrate = 115200, timeout = 2)
+        self.cmd("")
+
+    def cmd(self, line):
+        self.ser.write((line + "\r\n").encode())
+        reply = self.ser.read_until(b">> ").decode(errors = "ignore")
+        if not reply.endswith(">> "):
+            raise IOError(f"no prompt after '{line}'")
+
+        return reply
+
+    def spi(self, *chunks):
+        # one CS assertion, any number of DATA lines
+        self.cmd("ASSERT")
+        reply = [ self.cmd("DATA " + " ".join(f"{b:02x}" for b in c)) for c in chunks ]
+        self.cmd("RELEASE")
+
+        return reply
+
+    def wait(self):
+        while True:
+            status = self.spi([ 0x05, 0x00 ])[0].split()
+            if not int(status[-2], 16) & 1:
+                return
+
+    def write(self, addr, blob):
+        self.cmd("BEGIN")
+        for a in range(addr, addr + len(blob), 0x1000):
+            self.spi([ 0x06 ])
+            self.spi([ 0x20, (a >> 16) & 0xFF, (a >> 8) & 0xFF, a & 0xFF ])
+            self.wait()
+        for off in range(0, len(blob), 256):
+            a = addr + off
+            page = blob[off:off + 256]
+            self.spi([ 0x06 ])
+            self.spi([ 0x02, (a >> 16) & 0xFF, (a >> 8) & 0xFF, a & 0xFF ],
+                *[ page[i:i + DATA_BYTES] for i in range(0, len(page), DATA_BYTES) ])
+            self.wait()
+            print(f"\r{off + len(page)}/{len(blob)}", end = "", flush = True)
+        self.cmd("END")
+        print()
+
+        crc = self.cmd(f"CRC {addr:x} {len(blob):x}")
+        if f"CRC32 {zlib.crc32(blob):08x}" not in crc:
+            raise IOError("CRC mismatch after writing: " + crc.strip())
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser("Sword of Secrets asset packer")
+    parser.add_argument("--keys", default = "keys.h", help = "header holding the string macros")
+    parser.add_argument("--cc", default = "cc", help = "C compiler used as preprocessor")
+    parser.add_argument("--port", help = f"write the blob to the badge on this serial port (e.g. {SERPORT})")
+    parser.add_argument("-o", "--output", default = "assets.bin", help = "blob file")
+    args = parser.parse_args()
+
+    blob, addr = build(args.keys, args.cc)
+    with open(args.output, "wb") as f:
+        f.write(blob)
+    print(f"Generated {args.output}, {len(blob)} bytes for 0x{addr:x}")
+
+    if args.port:
+        Badge(args.port).write(addr, blob)
+        print("Done")
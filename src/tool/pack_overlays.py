@@ -0,0 +1,82 @@
+#!/usr/bin/python
+
+# Packs the overlay images listed in src/include/overlay.h (built by
+# `make overlays` as src/overlay/<name>.bin) into the blob written at
+# OVERLAY_ADDR, and generates the table the firmware checks them against.
+# Optionally writes the blob to the badge like pack_assets.py does.
+
+from Crypto.Cipher import AES
+import argparse
+import os
+import re
+
+from pack_assets import Badge, SERPORT
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..")
+OVERLAY_H = os.path.join(ROOT, "src", "include", "overlay.h")
+OVERLAY_DIR = os.path.join(ROOT, "src", "overlay")
+
+def define(src, name):
+    return int(re.search(rf"#define {name} (\w+)", src).group(1), 0)
+
+def overlay_list():
+    with open(OVERLAY_H) as f:
+        src = f.read()
+
+    names = { int(i): n for i, n in re.findall(r"#define OVERLAY_[A-Z]\w*[ \t]+(\d+)[ \t]+// (\w+)", src) }
+
+    return [ names[i] for i in range(len(names)) ], define(src, "OVERLAY_ADDR"), define(src, "OVERLAY_SLOT_SIZE")
+
+def digest(image):
+    # AES-128 Davies-Meyer, same as overlay_verify()
+    image += bytes(-len(image) % AES.block_size)
+    h = bytes(AES.block_size)
+    for i in range(0, len(image), AES.block_size):
+        e = AES.new(image[i:i + AES.block_size], AES.MODE_ECB).encrypt(h)
+        h = bytes(a ^ b for a, b in zip(e, h))
+
+    return h
+
+def build():
+    names, addr, slot = overlay_list()
+    blob = b""
+    table = []
+
+    for n in names:
+        with open(os.path.join(OVERLAY_DIR, n + ".bin"), "rb") as f:
+            image = f.read()
+        image += bytes(-len(image) % 4)
+        if len(image) > slot:
+            raise ValueError(f"{n}: {len(image)} bytes, the slot holds {slot}")
+        print(f"{n}: {len(image)} bytes")
+        table.append((n, len(blob), len(image), digest(image)))
+        blob += image
+
+    return blob, addr, table
+
+def header(table):
+    lines = [ "// Generated by src/tool/pack_overlays.py, don't edit",
+        "static const struct overlay_entry_s overlay_table[] = {" ]
+    for n, offset, size, d in table:
+        lines.append(f"    {{ 0x{offset:x}, {size}, {{ {', '.join(f'0x{b:02x}' for b in d)} }} }}, // {n}")
+    lines.append("};")
+
+    return "\n".join(lines) + "\n"
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser("Sword of Secrets overlay packer")
+    parser.add_argument("--port", help = f"write the blob to the badge on this serial port (e.g. {SERPORT})")
+    parser.add_argument("-o", "--output", default = "overlays.bin", help = "blob file")
+    parser.add_argument("--table", default = os.path.join(OVERLAY_DIR, "overlays.h"), help = "generated table for the firmware")
+    args = parser.parse_args()
+
+    blob, addr, table = build()
+    with open(args.output, "wb") as f:
+        f.write(blob)
+    with open(args.table, "w") as f:
+        f.write(header(table))
+    print(f"Generated {args.output}, {len(blob)} bytes for 0x{addr:x}")
+
+    if args.port:
+        Badge(args.port).write(addr, blob)
+        print("Done")
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ch32v003fun.h>
+#include "w25q.h"
+#include "hw.h"
+
+// Mock register layer. Time only moves when the driver does something that
+// takes time on the real part: SPI frames, delays, register accesses.
+// Clock is counted in CPU cycles at FUNCONF_SYSTEM_CORE_CLOCK.
+
+uint64_t sim_cycles;
+struct sim_errors_s sim_errors;
+uint32_t sim_frames;
+uint32_t sim_sck_max_hz;
+
+static SPI_TypeDef spi1;
+static uint32_t spi1_seen;      // CTLR1 as of the previous access
+static SysTick_Type systick;
+
+static uint16_t rx_fifo[2];
+static int rx_count;
+static uint32_t cs_low;         // chips with CS asserted, by pin
+
+uint64_t sim_ns(void)
+{
+    return sim_cycles * 1000 / (FUNCONF_SYSTEM_CORE_CLOCK / 1000000);
+}
+
+void sim_reset(void)
+{
+    sim_cycles = 0;
+    memset(&sim_errors, 0, sizeof(sim_errors));
+    sim_frames = 0;
+    sim_sck_max_hz = 0;
+    memset(&spi1, 0, sizeof(spi1));
+    spi1_seen = 0;
+    rx_count = 0;
+    cs_low = 0;
+    w25q_reset();
+}
+
+SPI_TypeDef * sim_spi1(void)
+{
+    // DFF only takes while SPE is off, undo changes made behind its back
+    if ((spi1_seen & SPI_CTLR1_SPE) && (spi1.CTLR1 & SPI_CTLR1_SPE) &&
+        ((spi1.CTLR1 ^ spi1_seen) & SPI_CTLR1_DFF))
+    {
+        spi1.CTLR1 ^= SPI_CTLR1_DFF;
+        sim_errors.dff_while_enabled++;
+    }
+    spi1_seen = spi1.CTLR1;
+    sim_cycles++;
+
+    return &spi1;
+}
+
+SysTick_Type * sim_systick(void)
+{
+    sim_cycles++;
+    systick.CNT = sim_cycles / 8;
+
+    return &systick;
+}
+
+// Pin n is the chip select of model chip n, other pins go nowhere
+void sim_gpio_write(int pin, int level)
+{
+    sim_cycles += 2;
+    if (pin < 0 || pin >= W25Q_CHIPS)
+    {
+        return;
+    }
+    if (level)
+    {
+        cs_low &= ~(1u << pin);
+    }
+    else
+    {
+        cs_low |= 1u << pin;
+    }
+    w25q_cs(pin, level, sim_ns());
+}
+
+void Delay_Us(uint32_t us)
+{
+    sim_cycles += (uint64_t)us * (FUNCONF_SYSTEM_CORE_CLOCK / 1000000);
+}
+
+void Delay_Ms(uint32_t ms)
+{
+    sim_cycles += (uint64_t)ms * (FUNCONF_SYSTEM_CORE_CLOCK / 1000);
+}
+
+void sim_spi_write(uint16_t data, uint32_t overhead)
+{
+    SPI_TypeDef *spi = sim_spi1();
+    // SCK is the bus clock divided by 2 << BR
+    uint32_t bit = 2u << ((spi->CTLR1 & SPI_CTLR1_BR) >> 3);
+    uint16_t rx;
+
+    if (!(spi->CTLR1 & SPI_CTLR1_SPE))
+    {
+        sim_errors.spe_off++;
+        return;
+    }
+
+    if (spi->CTLR1 & SPI_CTLR1_DFF)
+    {
+        sim_cycles += 8 * bit;
+        rx = w25q_xfer(data >> 8, sim_ns()) << 8;
+        sim_cycles += 8 * bit;
+        rx |= w25q_xfer(data, sim_ns());
+    }
+    else
+    {
+        if (data > 0xFF)
+        {
+            sim_errors.truncated++;
+        }
+        sim_cycles += 8 * bit;
+        rx = w25q_xfer(data, sim_ns());
+    }
+    if (sim_sck_max_hz && FUNCONF_SYSTEM_CORE_CLOCK / bit > sim_sck_max_hz)
+    {
+        rx ^= 0x0001;
+    }
+    sim_cycles += overhead;
+    sim_frames++;
+    if (cs_low & (cs_low - 1))
+    {
+        sim_errors.contention++;
+    }
+
+    // one frame in DATAR, one in the shift register, anything more and
+    // the RX side has overrun
+    if (rx_count == 2)
+    {
+        sim_errors.overrun++;
+        rx_fifo[0] = rx_fifo[1];
+        rx_count = 1;
+    }
+    rx_fifo[rx_count++] = rx;
+    spi->DATAR = rx;
+    spi->STATR |= SPI_STATR_RXNE | SPI_STATR_TXE;
+}
+
+uint16_t sim_spi_read(void)
+{
+    SPI_TypeDef *spi = sim_spi1();
+    uint16_t rx;
+
+    if (!rx_count)
+    {
+        sim_errors.underrun++;
+        return spi->DATAR;
+    }
+    rx = rx_fifo[0];
+    rx_fifo[0] = rx_fifo[1];
+    if (--rx_count == 0)
+    {
+        spi->STATR &= ~SPI_STATR_RXNE;
+    }
+
+    return rx;
+}
@@ -0,0 +1,29 @@
+#ifndef __SIM_HW_H__
+#define __SIM_HW_H__
+
+#include <stdint.h>
+
+// Things the real SPI peripheral would have silently done wrong
+struct sim_errors_s
+{
+    uint32_t spe_off;           // frame written with SPE clear
+    uint32_t truncated;         // 16 bit value written in 8 bit mode
+    uint32_t overrun;           // RX not read in time
+    uint32_t underrun;          // read with nothing received
+    uint32_t dff_while_enabled; // DFF changed while SPE was set
+    uint32_t contention;        // frame with more than one chip selected
+};
+
+extern uint64_t sim_cycles;
+extern uint32_t sim_frames;
+extern struct sim_errors_s sim_errors;
+
+// Fastest SCK the "board" carries cleanly, MISO drops a bit above it.
+// 0 means no limit.
+extern uint32_t sim_sck_max_hz;
+
+void sim_reset(void);
+
+uint64_t sim_ns(void);
+
+#endif // __SIM_HW_H__
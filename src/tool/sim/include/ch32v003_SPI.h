@@ -0,0 +1,99 @@
+#ifndef CH32V003_SPI_H
+#define CH32V003_SPI_H
+
+// Host stand-in for src/include/ch32v003_SPI.h, same API. Control bits go
+// to the mock SPI1 registers, data frames go through sim_spi_write() /
+// sim_spi_read() into the flash model. The wait helpers are no-ops, every
+// frame has finished by the time sim_spi_write() returns.
+
+#include <stdint.h>
+#include <ch32v003fun.h>
+
+#ifndef APB_CLOCK
+#define APB_CLOCK FUNCONF_SYSTEM_CORE_CLOCK
+#endif
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+#define LOG2(x) ((x) == 0 ? -1 : __builtin_ctz(x))
+
+#define SPI_CLK_RATIO (APB_CLOCK / CH32V003_SPI_SPEED_HZ)
+#define SPI_CLK_PRESCALER LOG2(SPI_CLK_RATIO)
+
+// CPU cycles the polled helpers spend around each frame
+#define SIM_SPI_TRANSFER_OVERHEAD 12
+#define SIM_SPI_WRITE_OVERHEAD    3
+
+void sim_spi_write(uint16_t data, uint32_t overhead);
+uint16_t sim_spi_read(void);
+
+static inline void SPI_init()
+{
+    SPI1->CTLR1 = 0;
+    SPI1->CTLR1 |= SPI_CTLR1_BR & (SPI_CLK_PRESCALER << 3);
+    SPI1->CTLR1 |= SPI_CTLR1_SSM | SPI_CTLR1_SSI | SPI_CTLR1_MSTR;
+}
+
+static inline void SPI_begin_8()
+{
+    SPI1->CTLR1 &= ~(SPI_CTLR1_DFF);
+    SPI1->CTLR1 |= SPI_CTLR1_SPE;
+}
+
+static inline void SPI_begin_16()
+{
+    SPI1->CTLR1 |= SPI_CTLR1_DFF;
+    SPI1->CTLR1 |= SPI_CTLR1_SPE;
+}
+
+static inline void SPI_end()
+{
+    SPI1->CTLR1 &= ~(SPI_CTLR1_SPE);
+}
+
+static inline uint8_t SPI_read_8()
+{
+    return sim_spi_read();
+}
+
+static inline uint16_t SPI_read_16()
+{
+    return sim_spi_read();
+}
+
+static inline void SPI_write_8(uint8_t data)
+{
+    sim_spi_write(data, SIM_SPI_WRITE_OVERHEAD);
+}
+
+static inline void SPI_write_16(uint16_t data)
+{
+    sim_spi_write(data, SIM_SPI_WRITE_OVERHEAD);
+}
+
+static inline uint8_t SPI_transfer_8(uint8_t data)
+{
+    sim_spi_write(data, SIM_SPI_TRANSFER_OVERHEAD);
+    return sim_spi_read();
+}
+
+static inline uint16_t SPI_transfer_16(uint16_t data)
+{
+    sim_spi_write(data, SIM_SPI_TRANSFER_OVERHEAD);
+    return sim_spi_read();
+}
+
+static inline void SPI_wait_TX_complete()
+{
+}
+
+static inline void SPI_wait_RX_available()
+{
+}
+
+static inline void SPI_wait_not_busy()
+{
+}
+
+#endif // CH32V003_SPI_H
@@ -0,0 +1,122 @@
+#ifndef __SIM_CH32V003FUN_H__
+#define __SIM_CH32V003FUN_H__
+
+// Host stand-in for the parts of ch32v003fun that the flash driver touches.
+// Registers are plain structs behind accessor functions, so the mock can
+// look at what the driver did since the last access (see hw.c).
+
+#include <stdint.h>
+
+#define FUNCONF_SYSTEM_CORE_CLOCK 48000000
+#define DELAY_US_TIME (FUNCONF_SYSTEM_CORE_CLOCK / 8000000)
+
+typedef struct
+{
+    volatile uint32_t CTLR1;
+    volatile uint32_t CTLR2;
+    volatile uint32_t STATR;
+    volatile uint32_t DATAR;
+} SPI_TypeDef;
+
+typedef struct
+{
+    volatile uint32_t CTLR;
+    volatile uint32_t SR;
+    volatile uint32_t CNT;
+    volatile uint32_t CMP;
+} SysTick_Type;
+
+// DMA1 and RCC are only declared, for the FLASH_USE_DMA=1 compile check.
+// The model has no DMA engine behind them.
+typedef struct
+{
+    volatile uint32_t CFGR;
+    volatile uint32_t CNTR;
+    volatile uint32_t PADDR;
+    volatile uint32_t MADDR;
+} DMA_Channel_TypeDef;
+
+typedef struct
+{
+    volatile uint32_t INTFR;
+    volatile uint32_t INTFCR;
+} DMA_TypeDef;
+
+typedef struct
+{
+    volatile uint32_t CTLR;
+    volatile uint32_t CFGR0;
+    volatile uint32_t INTR;
+    volatile uint32_t APB2PRSTR;
+    volatile uint32_t APB1PRSTR;
+    volatile uint32_t AHBPCENR;
+    volatile uint32_t APB2PCENR;
+    volatile uint32_t APB1PCENR;
+} RCC_TypeDef;
+
+#define SPI_CTLR1_CPHA      0x0001
+#define SPI_CTLR1_CPOL      0x0002
+#define SPI_CTLR1_MSTR      0x0004
+#define SPI_CTLR1_BR        0x0038
+#define SPI_CTLR1_SPE       0x0040
+#define SPI_CTLR1_SSI       0x0100
+#define SPI_CTLR1_SSM       0x0200
+#define SPI_CTLR1_DFF       0x0800
+
+#define SPI_CTLR2_RXDMAEN   0x0001
+#define SPI_CTLR2_TXDMAEN   0x0002
+
+#define DMA_CFGR1_EN        0x0001
+#define DMA_CFGR1_DIR       0x0010
+#define DMA_CFGR1_MINC      0x0080
+#define DMA_CFGR1_PL        0x3000
+
+#define DMA_TCIF2           0x00000020
+#define DMA1_Channel2_IT_Mask 0x000000F0
+#define DMA1_Channel3_IT_Mask 0x00000F00
+
+#define RCC_AHBPeriph_DMA1  0x00000001
+
+#define SPI_STATR_RXNE      0x0001
+#define SPI_STATR_TXE       0x0002
+#define SPI_STATR_OVR       0x0040
+#define SPI_STATR_BSY       0x0080
+
+SPI_TypeDef * sim_spi1(void);
+SysTick_Type * sim_systick(void);
+
+DMA_TypeDef * sim_dma1(void);
+DMA_Channel_TypeDef * sim_dma1_channel(int n);
+RCC_TypeDef * sim_rcc(void);
+
+#define SPI1    (sim_spi1())
+#define DMA1    (sim_dma1())
+#define DMA1_Channel2 (sim_dma1_channel(2))
+#define DMA1_Channel3 (sim_dma1_channel(3))
+#define RCC     (sim_rcc())
+#define SysTick (sim_systick())
+
+#define FUN_LOW  0
+#define FUN_HIGH 1
+
+#define GPIO_Speed_10MHz 1
+#define GPIO_Speed_50MHz 3
+#define GPIO_CNF_OUT_PP  0x00
+
+void sim_gpio_write(int pin, int level);
+
+#define funPinMode(pin, mode) ((void)(pin), (void)(mode))
+#define funDigitalWrite(pin, level) sim_gpio_write((pin), (level))
+
+void Delay_Us(uint32_t us);
+void Delay_Ms(uint32_t ms);
+
+// UART output, sim.c captures it
+int _write(int fd, const char *buf, int size);
+
+// single threaded host, nothing to mask
+static inline uint32_t __isenabled_irq(void) { return 1; }
+static inline void __disable_irq(void) { }
+static inline void __enable_irq(void) { }
+
+#endif // __SIM_CH32V003FUN_H__
@@ -0,0 +1,8 @@
+#ifndef __SIM_OVERLAYS_H__
+#define __SIM_OVERLAYS_H__
+
+// Host stand-in for the table pack_overlays.py generates. The sim can't
+// build overlay images, testOverlay() writes one and fills this in.
+extern struct overlay_entry_s overlay_table[2];
+
+#endif // __SIM_OVERLAYS_H__
@@ -0,0 +1,1094 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <flash.h>
+#include <journal.h>
+#include <kv.h>
+#include <record.h>
+#include <otp.h>
+#include <bench.h>
+#include <asset.h>
+#include <overlay.h>
+#include <ch32v003fun.h>
+#include "w25q.h"
+#include "hw.h"
+
+// Runs src/spiflash.c against the W25Q128 model and reports virtual-time
+// throughput and latency. Exits non-zero if data or bus behaviour is wrong.
+
+#define SIM_CS_PIN 0
+#define SIM_CS2_PIN 1       // second model chip
+#define SIM_NC_PIN 5        // nothing attached
+
+#define CYCLES_PER_US (48)
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            failures++; \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+static uint8_t pattern[4096];
+static uint8_t buf[4096];
+
+static char uart[1024];
+static int uart_len;
+
+int _write(int fd, const char * p, int size)
+{
+    (void)fd;
+    for (int i = 0; i < size && uart_len < (int)sizeof(uart); i++)
+    {
+        uart[uart_len++] = p[i];
+    }
+
+    return size;
+}
+
+static uint32_t elapsed_us(uint64_t start)
+{
+    return (sim_cycles - start) / CYCLES_PER_US;
+}
+
+static uint32_t kbps(uint32_t bytes, uint32_t us)
+{
+    return us ? (uint32_t)((uint64_t)bytes * 1000 / us) : 0;
+}
+
+static uint32_t crc32_ref(const uint8_t * p, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+// idle at the prompt for a while
+static void idle_ms(uint32_t ms)
+{
+    for (uint32_t i = 0; i < ms; i++)
+    {
+        Delay_Ms(1);
+        flash_job_poll();
+    }
+}
+
+static void testInit()
+{
+    CHECK(flash_init(SIM_CS_PIN), "flash_init");
+    CHECK(flash_dev->geom.sfdp, "SFDP not parsed");
+    CHECK(flash_dev->geom.size == W25Q_SIZE, "size %u", flash_dev->geom.size);
+    CHECK(flash_dev->geom.block_op == 0x52 && flash_dev->geom.block_shift == 15, "block erase %02x/%u",
+        flash_dev->geom.block_op, flash_dev->geom.block_shift);
+    printf("init: %u bytes, erase %02x/%02x/%02x, %u us\n", flash_dev->geom.size,
+        flash_dev->geom.erase_op[0], flash_dev->geom.erase_op[1], flash_dev->geom.erase_op[2],
+        (uint32_t)(sim_cycles / CYCLES_PER_US));
+
+    flash_ext_cmds.read = 0x48;
+    flash_ext_cmds.write = 0x42;
+    flash_ext_cmds.erase = 0x44;
+}
+
+#if FLASH_CALIBRATE
+// A board that only carries 7 MHz passes at HCLK/8 (6 MHz) and fails at
+// HCLK/4, so it ends up one step slower at HCLK/16. The pattern is written
+// once, and the full speed comes back on a clean bus.
+static void testCalibrate()
+{
+    uint32_t programs, erases;
+    uint64_t start;
+    uint8_t br;
+
+    br = flash_calibrate();
+    CHECK(br == 0, "prescaler %u on a clean bus", br);
+    CHECK(w25q[0].mem[FLASH_CAL_ADDR] == 0xAA && w25q[0].mem[FLASH_CAL_ADDR + 255] == 0x00,
+        "calibration pattern not written");
+
+    programs = w25q[0].stats.programs;
+    erases = w25q[0].stats.erases;
+    sim_sck_max_hz = 7000000;
+    start = sim_cycles;
+    br = flash_calibrate();
+    CHECK(br == 3, "prescaler %u with a 7 MHz limit", br);
+    CHECK(w25q[0].stats.programs == programs && w25q[0].stats.erases == erases, "pattern rewritten");
+    flash_read(0x100, buf, 64);
+    CHECK(!memcmp(buf, pattern + 0x100, 64), "read at the calibrated clock");
+    printf("calibrate: HCLK/%d with a 7 MHz limit, %u us\n", 2 << br, elapsed_us(start));
+
+    sim_sck_max_hz = 0;
+    CHECK(flash_calibrate() == 0, "prescaler not restored");
+}
+#endif
+
+static void testProgram()
+{
+    uint64_t start;
+
+    for (unsigned i = 0; i < sizeof(pattern); i++)
+    {
+        pattern[i] = i * 7 + (i >> 8);
+    }
+
+    start = sim_cycles;
+    flash_erase_range(0, 0x10000);
+    flash_write(0, pattern, sizeof(pattern));
+    printf("erase 64K + program 4K: %u us, %u erases, %u programs\n", elapsed_us(start),
+        w25q[0].stats.erases, w25q[0].stats.programs);
+    CHECK(w25q[0].stats.erases == 1, "64K range took %u erases", w25q[0].stats.erases);
+}
+
+static void testReadModes()
+{
+    static const char * const names[] = { "normal", "fast", "dma" };
+    uint64_t start;
+    uint32_t us;
+
+    for (uint8_t mode = FLASH_READ_NORMAL; mode <= FLASH_READ_FAST; mode++)
+    {
+        flash_set_read_mode(mode);
+        memset(buf, 0, sizeof(buf));
+        start = sim_cycles;
+        flash_read(0, buf, sizeof(buf));
+        us = elapsed_us(start);
+        CHECK(!memcmp(buf, pattern, sizeof(buf)), "%s read mismatch", names[mode]);
+        printf("read %s: 4096 bytes in %u us (%u KB/s)\n", names[mode], us, kbps(sizeof(buf), us));
+    }
+
+    memset(buf, 0, sizeof(buf));
+    start = sim_cycles;
+    flash_stream_open(0, sizeof(buf));
+    for (unsigned i = 0; i < sizeof(buf); i += 32)
+    {
+        flash_stream_read(buf + i, 32);
+    }
+    flash_stream_close();
+    us = elapsed_us(start);
+    CHECK(!memcmp(buf, pattern, sizeof(buf)), "stream read mismatch");
+    printf("read stream: 4096 bytes in 32 byte pulls, %u us (%u KB/s)\n", us, kbps(sizeof(buf), us));
+
+    start = sim_cycles;
+    CHECK(flash_crc32(0, sizeof(pattern)) == crc32_ref(pattern, sizeof(pattern)), "crc32");
+    printf("crc32: 4096 bytes in %u us\n", elapsed_us(start));
+
+    // small reads, through the cache
+    start = sim_cycles;
+    for (int i = 0; i < 64; i++)
+    {
+        flash_read((i & 7) * 8, buf, 8);
+    }
+    printf("read 8 bytes x 64 (cached): %u us\n", elapsed_us(start));
+
+#if FLASH_PREFETCH
+    // walking forward 8 bytes at a time: after the first miss every
+    // command brings two lines
+    uint32_t reads = w25q[0].stats.reads, hits = flash_stats.prefetch_hits;
+
+    flash_cache_invalidate(0x400, 0x100);
+    for (int i = 0; i < 32; i++)
+    {
+        flash_read(0x400 + i * 8, buf + i * 8, 8);
+    }
+    CHECK(!memcmp(buf, pattern + 0x400, 0x100), "sequential read mismatch");
+    CHECK(w25q[0].stats.reads - reads == 5, "%u commands for 8 lines", w25q[0].stats.reads - reads);
+    CHECK(flash_stats.prefetch_hits - hits == 3, "%u lines read ahead used", flash_stats.prefetch_hits - hits);
+#endif
+}
+
+static void testSuspend()
+{
+    uint64_t start;
+    uint32_t us, suspends = w25q[0].stats.suspends;
+
+    flash_erase_block(0x20000);
+    Delay_Ms(5);
+
+    start = sim_cycles;
+    flash_read(0x100, buf, 32);
+    us = elapsed_us(start);
+    CHECK(!memcmp(buf, pattern + 0x100, 32), "read during erase mismatch");
+    CHECK(w25q[0].stats.suspends - suspends == 1, "%u suspends", w25q[0].stats.suspends - suspends);
+    CHECK(us < 200, "read during erase took %u us", us);
+    printf("read 32 bytes during block erase: %u us\n", us);
+
+    start = sim_cycles;
+    flash_read_ext(0x1000, buf, 16);
+    us = elapsed_us(start);
+    printf("read_ext 16 bytes during block erase: %u us\n", us);
+
+    // let the erase finish, then check it did
+    Delay_Ms(200);
+    flash_read(0x20000, buf, 256);
+    for (int i = 0; i < 256; i++)
+    {
+        CHECK(buf[i] == 0xFF, "0x%x not erased", 0x20000 + i);
+        if (buf[i] != 0xFF)
+        {
+            break;
+        }
+    }
+    CHECK(w25q[0].stats.resumes == w25q[0].stats.suspends, "%u suspends, %u resumes",
+        w25q[0].stats.suspends, w25q[0].stats.resumes);
+}
+
+static void testUpdate()
+{
+    uint8_t rec[16];
+    uint32_t erases = w25q[0].stats.erases;
+
+    memset(rec, 0x5A, sizeof(rec));
+    CHECK(flash_update(0x30000, rec, sizeof(rec)) == FLASH_UPDATE_PROGRAM, "program into erased");
+    CHECK(flash_update(0x30000, rec, sizeof(rec)) == FLASH_UPDATE_SAME, "same data");
+    rec[0] = 0x50;
+    CHECK(flash_update(0x30000, rec, sizeof(rec)) == FLASH_UPDATE_PROGRAM, "clear bits");
+    rec[0] = 0xA5;
+    CHECK(flash_update(0x30000, rec, sizeof(rec)) == FLASH_UPDATE_ERASE, "set bits");
+    CHECK(w25q[0].stats.erases == erases + 1, "%u erases for one update", w25q[0].stats.erases - erases);
+
+    flash_read(0x30000, buf, sizeof(rec));
+    CHECK(!memcmp(buf, rec, sizeof(rec)), "update readback");
+}
+
+static void idleJournal(struct journal_s * j)
+{
+    for (uint32_t i = 0; i < 10000 && (pool_ready(&j->pool) < JOURNAL_ERASE_AHEAD || j->pool.cur != POOL_NONE); i++)
+    {
+        Delay_Us(100);
+        flash_job_poll();
+        journal_poll(j);
+    }
+}
+
+// With the spare block erased while idle, starting a new block only costs
+// a program. A free block left half erased by a power loss is erased again.
+static void testJournalEraseAhead(struct journal_s * j)
+{
+    uint32_t data[2] = { 0x5A5A, 0xA5A5 }, got[2];
+    uint32_t erases, us, spare;
+    uint64_t start;
+
+    idleJournal(j);
+    CHECK(pool_ready(&j->pool) == JOURNAL_ERASE_AHEAD, "%u blocks erased ahead", pool_ready(&j->pool));
+    while (j->next % JOURNAL_BLOCK_SIZE)
+    {
+        journal_append(j, data);
+    }
+
+    erases = w25q[0].stats.erases;
+    start = sim_cycles;
+    journal_append(j, data);
+    us = elapsed_us(start);
+    CHECK(w25q[0].stats.erases == erases, "append into a new block erased inline");
+    CHECK(us < 1000, "append into a new block took %u us", us);
+    printf("journal: append into a new block %u us\n", us);
+
+    idleJournal(j);
+    CHECK(w25q[0].stats.erases == erases + 1, "old block not erased ahead");
+    // two blocks, the spare is the one without the head
+    spare = (j->last - 0x900000 < JOURNAL_BLOCK_SIZE) ? 0x900000 + JOURNAL_BLOCK_SIZE : 0x900000;
+
+    // reset with the spare's erase cut short
+    w25q[0].mem[spare + JOURNAL_BLOCK_SIZE / 2] = 0x00;
+    journal_mount(j, 0x900000);
+    CHECK(journal_read(j, got) && got[0] == data[0], "journal lost its head");
+    idleJournal(j);
+    CHECK(w25q[0].stats.erases == erases + 2, "torn spare not erased again");
+    CHECK(w25q[0].mem[spare + JOURNAL_BLOCK_SIZE / 2] == 0xFF, "torn spare handed out");
+}
+
+// Every sector held by the owner: nothing to hand out until one is released
+static void testPoolFull()
+{
+    struct pool_s p;
+    uint32_t frames;
+
+    pool_init(&p, 0x980000, JOURNAL_BLOCK_SIZE, 2, 1);
+    pool_claim(&p, 0x980000);
+    pool_claim(&p, 0x980000 + JOURNAL_BLOCK_SIZE);
+    CHECK(pool_take(&p) == POOL_FULL, "full pool handed out a sector");
+    pool_release(&p, 0x980000 + JOURNAL_BLOCK_SIZE);
+    CHECK(pool_take(&p) == 0x980000 + JOURNAL_BLOCK_SIZE, "released sector not handed out");
+
+    // a CLI session holds the bus: no blank checks, and a take that would
+    // wait for the erase fails instead of spinning
+    pool_init(&p, 0x980000, JOURNAL_BLOCK_SIZE, 2, 1);
+    pool_claim(&p, 0x980000);
+    flash_write(0x980000 + JOURNAL_BLOCK_SIZE, pattern, 16);
+    flash_wait_ready(0, NULL);
+    pool_poll(&p);
+    CHECK(p.job >= 0, "dirty sector not queued for erase");
+    SPI1->CTLR1 |= SPI_CTLR1_SPE;
+    frames = sim_frames;
+    pool_poll(&p);
+    CHECK(sim_frames == frames, "pool touched the bus during a CLI session");
+    CHECK(pool_take(&p) == POOL_FULL, "pool handed out a sector during a CLI session");
+    SPI1->CTLR1 &= ~SPI_CTLR1_SPE;
+    CHECK(pool_take(&p) == 0x980000 + JOURNAL_BLOCK_SIZE, "sector not handed out after the session");
+    flash_read(0x980000 + JOURNAL_BLOCK_SIZE, buf, 16);
+    CHECK(buf[0] == 0xFF && !memcmp(buf, buf + 1, 15), "sector handed out before its erase");
+}
+
+#define KV_BASE 0xA00000
+
+static void idleKV(struct kv_s * kv)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        Delay_Us(100);
+        flash_job_poll();
+        kv_poll(kv);
+    }
+}
+
+// Overwrites, deletes and remounts; enough rewrites of one big value to
+// collect pages a few times; a record torn by a reset is skipped.
+static void testKV()
+{
+    struct kv_s kv;
+    uint32_t reads, v = 0;
+    char val[16];
+    int n;
+
+    kv_mount(&kv, KV_BASE);
+    CHECK(kv_get(&kv, "name", val, sizeof(val)) < 0, "empty store has a key");
+    CHECK(kv_put(&kv, "name", "sword", 5), "put failed");
+    CHECK(kv_put(&kv, "level", &v, sizeof(v)), "put failed");
+    CHECK(kv_put(&kv, "gone", "x", 1), "put failed");
+    CHECK(kv_put(&kv, "name", "secrets", 7), "overwrite failed");
+    CHECK(kv_del(&kv, "gone"), "delete failed");
+    CHECK(!kv_del(&kv, "gone"), "deleted twice");
+
+    flash_cache_invalidate(KV_BASE, KV_PAGE_SIZE * KV_PAGES);
+    reads = w25q[0].stats.reads;
+    n = kv_get(&kv, "name", val, sizeof(val));
+    CHECK(n == 7 && !memcmp(val, "secrets", 7), "get returned %d", n);
+    CHECK(w25q[0].stats.reads - reads == 1, "get took %u reads", w25q[0].stats.reads - reads);
+
+    kv_mount(&kv, KV_BASE);
+    CHECK(kv.keys == 2, "%u keys after remount", kv.keys);
+    n = kv_get(&kv, "name", val, sizeof(val));
+    CHECK(n == 7 && !memcmp(val, "secrets", 7), "remount get returned %d", n);
+    CHECK(kv_get(&kv, "gone", val, sizeof(val)) < 0, "deleted key back after remount");
+
+    // ~3 times the store, every page gets collected
+    for (v = 0; v < 300; v++)
+    {
+        memset(buf, v, KV_VALUE_MAX);
+        if (!kv_put(&kv, "blob", buf, KV_VALUE_MAX))
+        {
+            CHECK(0, "put %u failed", v);
+            break;
+        }
+        if (v % 16 == 0)
+        {
+            idleKV(&kv);
+        }
+    }
+    kv_mount(&kv, KV_BASE);
+    n = kv_get(&kv, "blob", buf, KV_VALUE_MAX);
+    CHECK(n == KV_VALUE_MAX && buf[0] == 299 % 256 && buf[KV_VALUE_MAX - 1] == 299 % 256, "blob lost, %d", n);
+    n = kv_get(&kv, "name", val, sizeof(val));
+    CHECK(n == 7 && !memcmp(val, "secrets", 7), "collection lost a key, %d", n);
+    CHECK(kv_get(&kv, "level", &v, sizeof(v)) == sizeof(v) && v == 0, "collection lost a key");
+
+    // reset halfway through programming the value
+    v = 1;
+    kv_put(&kv, "level", &v, sizeof(v));
+    flash_wait_ready(0, NULL);
+    // first value byte: 8 byte header, 5 byte key, 4 byte value, 3 padding
+    w25q[0].mem[kv.next - 7] &= 0xFE;
+    flash_cache_invalidate(kv.next - 20, 20);
+    kv_mount(&kv, KV_BASE);
+    CHECK(kv_get(&kv, "level", &v, sizeof(v)) == sizeof(v) && v == 0, "torn record read back");
+    v = 2;
+    CHECK(kv_put(&kv, "level", &v, sizeof(v)), "put after a torn record failed");
+    kv_mount(&kv, KV_BASE);
+    CHECK(kv_get(&kv, "level", &v, sizeof(v)) == sizeof(v) && v == 2, "put after a torn record lost");
+
+    // a chip stuck busy: the put fails, the page is closed and the next
+    // put goes to a fresh one
+    flash_erase_block(0x80000);
+    w25q[0].active.end += 10000000000ull;
+    v = 3;
+    CHECK(!kv_put(&kv, "level", &v, sizeof(v)), "put on a stuck chip");
+    w25q[0].active.end -= 10000000000ull;
+    flash_wait_ready(0, NULL);
+    v = 4;
+    CHECK(kv_put(&kv, "level", &v, sizeof(v)), "put after a stuck chip failed");
+    kv_mount(&kv, KV_BASE);
+    CHECK(kv_get(&kv, "level", &v, sizeof(v)) == sizeof(v) && v == 4, "put after a stuck chip lost, %u", v);
+    printf("kv: %u keys, page %x\n", kv.keys, kv.page);
+}
+
+
+static void testJournal()
+{
+    struct journal_s j;
+    uint32_t data[2], got[2];
+    uint64_t start = sim_cycles;
+
+    journal_mount(&j, 0x900000);
+    for (uint32_t i = 0; i < 3000; i++)
+    {
+        data[0] = i;
+        data[1] = ~i;
+        journal_append(&j, data);
+    }
+    journal_mount(&j, 0x900000);
+    CHECK(journal_read(&j, got), "journal empty");
+    CHECK(got[0] == 2999 && got[1] == ~2999u, "journal has %u", got[0]);
+    printf("journal: 3000 appends + mount, %u ms\n", elapsed_us(start) / 1000);
+    testJournalEraseAhead(&j);
+    testPoolFull();
+}
+
+#define RECORD_ADDR 0xA20000
+
+// A record and its trailing field in one read command, lengths clamped
+static void testRecord()
+{
+    struct __attribute__((packed))
+    {
+        size_t len;
+        char body[8];
+        char tail[4];
+    } legacy = { 8, "payload", "TAIL" };
+    char body[8], tail[4], small[4];
+    uint32_t reads;
+    size_t len;
+    int n;
+
+    flash_update(RECORD_ADDR, &legacy, sizeof(legacy));
+    flash_cache_invalidate(RECORD_ADDR, 0x1000);
+    reads = w25q[0].stats.reads;
+    len = record_read(RECORD_ADDR, body, sizeof(body), tail, sizeof(tail));
+    CHECK(w25q[0].stats.reads - reads == 1, "legacy record took %u reads", w25q[0].stats.reads - reads);
+    CHECK(len == 8 && !memcmp(body, "payload", 8) && !memcmp(tail, "TAIL", 4), "legacy record, %u bytes", (unsigned)len);
+    len = record_read(RECORD_ADDR, small, sizeof(small), NULL, 0);
+    CHECK(len == sizeof(small) && !memcmp(small, "payl", 4), "legacy length not clamped, %u", (unsigned)len);
+
+    CHECK(record_put(RECORD_ADDR + 0x100, 7, "typed", 5), "put failed");
+    CHECK(!record_put(RECORD_ADDR + 0x200, 7, buf, RECORD_PAYLOAD_MAX + 1), "oversized put");
+    reads = w25q[0].stats.reads;
+    n = record_get(RECORD_ADDR + 0x100, 7, body, sizeof(body));
+    CHECK(w25q[0].stats.reads - reads == 1, "typed record took %u reads", w25q[0].stats.reads - reads);
+    CHECK(n == 5 && !memcmp(body, "typed", 5), "typed record returned %d", n);
+    CHECK(record_get(RECORD_ADDR + 0x100, 8, body, sizeof(body)) < 0, "wrong type accepted");
+    CHECK(record_get(RECORD_ADDR + 0x100, 7, small, sizeof(small)) < 0, "too long for the buffer");
+    CHECK(record_get(RECORD_ADDR + 0x200, 7, body, sizeof(body)) < 0, "erased flash accepted");
+
+    flash_wait_ready(0, NULL);
+    w25q[0].mem[RECORD_ADDR + 0x100 + sizeof(struct record_hdr_s) + 4] = 0x00;
+    flash_cache_invalidate(RECORD_ADDR, 0x1000);
+    CHECK(record_get(RECORD_ADDR + 0x100, 7, body, sizeof(body)) < 0, "torn record accepted");
+}
+
+static void testExt()
+{
+    uint8_t rec[16];
+
+    memset(rec, 0x3C, sizeof(rec));
+    flash_erase_block_ext(0x2000);
+    flash_write_ext(0x2000, rec, sizeof(rec));
+    flash_read_ext(0x2000, buf, sizeof(rec));
+    CHECK(!memcmp(buf, rec, sizeof(rec)), "security register readback");
+}
+
+// Security register 3 through the mirror: one read per register, one
+// erase and one program per flush, nothing programmed once it's locked
+static void testOTP()
+{
+    struct w25q_stats_s * st = &w25q[0].stats;
+    uint32_t reads, programs, erases;
+    uint8_t got[8];
+
+    otp_invalidate();
+    reads = st->reads;
+    otp_read(0x3000, got, 4);
+    otp_read(0x3080, got, 8);
+    CHECK(st->reads - reads == 1, "%u reads for one register", st->reads - reads);
+
+    programs = st->programs;
+    erases = st->erases;
+    otp_erase(0x3000);
+    otp_write(0x3000, "ab", 2);
+    otp_write(0x3010, "cd", 2);
+    otp_write(0x30FF, "ef", 2); // wraps to 0x3000
+    otp_flush();
+    CHECK(st->erases - erases == 1 && st->programs - programs == 1,
+        "flush took %u erases, %u programs", st->erases - erases, st->programs - programs);
+    flash_read_ext(0x3000, buf, 256);
+    CHECK(buf[0] == ('a' & 'f') && buf[1] == 'b' && buf[0x10] == 'c' && buf[0x11] == 'd' && buf[0xFF] == 'e' &&
+        buf[2] == 0xFF, "register 3 after flush");
+    reads = st->reads;
+    otp_read(0x3010, got, 2);
+    CHECK(st->reads == reads && !memcmp(got, "cd", 2), "flushed register not mirrored");
+
+    w25q[0].sr2 |= 0x20;
+    CHECK(otp_locked() == 4, "lock bits %x", otp_locked());
+    programs = st->programs;
+    otp_write(0x3020, "\0", 1);
+    otp_flush();
+    CHECK(st->programs == programs, "locked register programmed");
+    otp_read(0x3020, got, 1);
+    CHECK(got[0] == 0xFF, "mirror kept a write the chip refused");
+    w25q[0].sr2 &= ~0x20;
+
+    // other opcodes go straight to the chip
+    flash_ext_cmds.read = 0x03;
+    reads = st->reads;
+    otp_read(0x3000, got, 4);
+    otp_read(0x3000, got, 4);
+    CHECK(st->reads - reads == 2, "mirror used with opcode 0x03");
+    flash_ext_cmds.read = 0x48;
+}
+
+static int yields;
+
+static void countYield(void)
+{
+    yields++;
+}
+
+// One status command for the whole wait, however long it runs
+static void testWait()
+{
+    uint32_t commands, timeouts;
+    uint64_t start;
+
+    flash_erase_block(0x80000);
+    commands = w25q[0].stats.commands;
+    start = sim_cycles;
+    CHECK(flash_wait_ready(0, countYield), "wait for erase");
+    CHECK(w25q[0].stats.commands - commands == 1, "%u commands to wait", w25q[0].stats.commands - commands);
+    CHECK(yields > 0 && !flash_is_busy(), "%d yields", yields);
+    printf("wait: 32K erase in %u us, %d yields\n", elapsed_us(start), yields);
+
+    flash_erase_block(0x80000);
+    timeouts = flash_stats.wait_timeouts;
+    start = sim_cycles;
+    CHECK(!flash_wait_ready(1, NULL), "1 ms wait for an erase");
+    CHECK(elapsed_us(start) < 1100, "timed out after %u us", elapsed_us(start));
+    CHECK(flash_stats.wait_timeouts == timeouts + 1 && flash_is_busy(), "timeout not counted");
+
+    // the driver's own waits yield too
+    flash_set_yield(countYield);
+    yields = 0;
+    flash_write(0x80000, pattern, 16);
+    flash_set_yield(NULL);
+    CHECK(yields > 0, "no yields while the erase finished");
+    flash_read(0x80000, buf, 16);
+    CHECK(!memcmp(buf, pattern, 16), "program after a timed out wait");
+
+    // a chip that never finishes gets nothing after the status polls
+    flash_erase_block(0x80000);
+    w25q[0].active.end += 10000000000ull;
+    commands = w25q[0].stats.programs + w25q[0].stats.erases + w25q[0].stats.ignored_busy;
+    CHECK(!flash_write(0x90000, pattern, 16), "program on a stuck chip");
+    CHECK(!flash_erase_range(0x90000, 16), "erase on a stuck chip");
+    CHECK(w25q[0].stats.programs + w25q[0].stats.erases + w25q[0].stats.ignored_busy == commands,
+        "commands sent to a stuck chip");
+    w25q[0].active.end -= 10000000000ull;
+    CHECK(flash_wait_ready(0, NULL), "stuck erase never finished");
+
+    // a suspend the chip never acts on: the read gives up after the
+    // timeout with erased bytes, nothing gets cached, the erase goes on
+    flash_write(0x90000, pattern, 16);
+    flash_erase_block(0x80000);
+    w25q[0].active.end += 10000000000ull;
+    w25q[0].drop_suspend = 1;
+    timeouts = flash_stats.wait_timeouts;
+    memset(buf, 0, 16);
+    flash_read(0x90000, buf, 16);
+    CHECK(flash_stats.wait_timeouts == timeouts + 1, "suspend never timed out");
+    CHECK(buf[0] == 0xFF && !memcmp(buf, buf + 1, 15), "read from a chip that never suspended");
+    w25q[0].drop_suspend = 0;
+    w25q[0].active.end -= 10000000000ull;
+    CHECK(flash_wait_ready(0, NULL), "unsuspended erase never finished");
+    flash_read(0x90000, buf, 16);
+    CHECK(!memcmp(buf, pattern, 16), "read after a timed out suspend");
+}
+
+// A part without a 32K erase: flash_erase_block() and erase jobs still
+// clear exactly one block, in 4K steps. Without anything that small the
+// erase is refused.
+static void testBlockErase()
+{
+    struct flash_geom_s geom = flash_dev->geom;
+    const uint32_t base = 0xB0000, size = 1ul << FLASH_BLOCK_SHIFT;
+    uint32_t erases;
+    int h;
+
+    flash_dev->geom.block_op = 0x20;
+    flash_dev->geom.block_shift = 12;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        flash_erase_range(base - 0x1000, size + 0x2000);
+        flash_write(base - 16, pattern, 16);
+        flash_write(base, pattern, 16);
+        flash_write(base + size - 16, pattern, 16);
+        flash_write(base + size, pattern, 16);
+
+        erases = w25q[0].stats.erases;
+        if (pass)
+        {
+            h = flash_job_erase(base + 0x1234, NULL);
+            CHECK(h >= 0, "erase job refused");
+            while (!flash_job_done(h))
+            {
+                Delay_Us(100);
+                flash_job_poll();
+            }
+        }
+        else
+        {
+            CHECK(flash_erase_block(base + 0x1234), "block erase refused");
+        }
+        flash_wait_ready(0, NULL);
+        CHECK(w25q[0].stats.erases - erases == 8, "%u erases for a 32K block", w25q[0].stats.erases - erases);
+        CHECK(w25q[0].mem[base] == 0xFF && w25q[0].mem[base + size - 1] == 0xFF, "block not erased");
+        CHECK(!memcmp(&w25q[0].mem[base - 16], pattern, 16) && !memcmp(&w25q[0].mem[base + size], pattern, 16),
+            "erase ran past the block");
+    }
+
+    flash_dev->geom.block_op = 0;
+    CHECK(!flash_erase_block(base), "block erase without a small enough erase type");
+    CHECK(flash_job_erase(base, NULL) < 0, "erase job without a small enough erase type");
+    flash_dev->geom = geom;
+}
+
+static void testJobs()
+{
+    static uint8_t page[512];
+    int h;
+
+    memset(page, 0x11, sizeof(page));
+    flash_job_erase(0x40000, NULL);
+    h = flash_job_program(0x40000, page, sizeof(page), NULL);
+    CHECK(h >= 0, "job queue full");
+    while (!flash_job_done(h))
+    {
+        Delay_Us(100);
+        flash_job_poll();
+    }
+    flash_read(0x40000, buf, sizeof(page));
+    CHECK(!memcmp(buf, page, sizeof(page)), "job program readback");
+
+    // a full queue can't drain while a CLI session holds the bus, so
+    // adding to it fails instead of spinning
+    CHECK(flash_job_free() == FLASH_JOB_SLOTS, "%u free slots in an empty queue", flash_job_free());
+    SPI1->CTLR1 |= SPI_CTLR1_SPE;
+    CHECK(flash_job_free() == 0, "free slots while the bus is held");
+    for (h = 0; h < FLASH_JOB_SLOTS; h++)
+    {
+        flash_job_call(NULL);
+    }
+    CHECK(flash_job_call(NULL) < 0, "job added to a full queue");
+    SPI1->CTLR1 &= ~SPI_CTLR1_SPE;
+    flash_job_flush();
+}
+
+static void testInterleave()
+{
+    static struct flash_dev_s dev2, none;
+    static uint8_t page[512];
+    struct flash_dev_s *prev;
+    uint64_t start;
+    uint32_t us;
+    int h0, h2;
+
+    CHECK(!flash_dev_init(&none, SIM_NC_PIN), "flash_dev_init on an empty pin");
+    CHECK(flash_dev_init(&dev2, SIM_CS2_PIN), "flash_dev_init");
+    CHECK(flash_dev == &flash_dev0, "flash_dev_init changed the selection");
+    CHECK(dev2.geom.size == W25Q_SIZE, "second chip size %u", dev2.geom.size);
+
+    // erase on the second chip while the first one is programmed and read
+    start = sim_cycles;
+    prev = flash_select(&dev2);
+    flash_erase_range(0, 0x10000);
+    flash_select(prev);
+    flash_erase_range(0x50000, 0x1000);
+    flash_write(0x50000, pattern, sizeof(pattern));
+    flash_read(0x50000, buf, sizeof(buf));
+    us = elapsed_us(start);
+    CHECK(!memcmp(buf, pattern, sizeof(buf)), "first chip readback");
+    CHECK(!w25q[0].stats.ignored_busy && !w25q[1].stats.suspends, "chips got in each other's way");
+    CHECK(us < 100000, "first chip waited for the second one, %u us", us);
+    printf("interleave: erase 4K + program/read 4K next to a 64K erase: %u us\n", us);
+
+    // a block erase and a program queued on each chip
+    memset(page, 0x22, sizeof(page));
+    flash_select(&dev2);
+    while (flash_is_busy())
+    {
+        Delay_Ms(1);
+    }
+    start = sim_cycles;
+    flash_job_erase(0x60000, NULL);
+    h2 = flash_job_program(0x60000, page, sizeof(page), NULL);
+    flash_select(prev);
+    flash_job_erase(0x60000, NULL);
+    h0 = flash_job_program(0x60000, page, sizeof(page), NULL);
+    CHECK(h0 >= 0 && h2 >= 0, "job queue full");
+    while (!flash_job_done(h0) || !flash_job_done(h2))
+    {
+        Delay_Us(100);
+        flash_job_poll();
+    }
+    us = elapsed_us(start);
+    CHECK(!memcmp(&w25q[0].mem[0x60000], page, sizeof(page)), "first chip job readback");
+    CHECK(!memcmp(&w25q[1].mem[0x60000], page, sizeof(page)), "second chip job readback");
+    CHECK(w25q[1].mem[0] == 0xFF && w25q[1].mem[0xFFFF] == 0xFF, "second chip not erased");
+    CHECK(us < W25Q_TBE1_NS / 1000 * 3 / 2, "jobs ran one chip after the other, %u us", us);
+    printf("interleave: 32K erase + 512 byte program on two chips: %u us\n", us);
+
+    flash_select(&dev2);
+    flash_read(0x60000, buf, sizeof(page));
+    flash_select(prev);
+    CHECK(!memcmp(buf, page, sizeof(page)), "second chip read through the driver");
+}
+
+// Hand-rolled asset stream encoder
+static uint8_t *enc_p, *enc_flags;
+static int enc_bits;
+
+static void encToken(int literal, int a, int b)
+{
+    if (enc_bits == 8)
+    {
+        enc_flags = enc_p++;
+        *enc_flags = 0;
+        enc_bits = 0;
+    }
+    if (literal)
+    {
+        *enc_flags |= 1 << enc_bits;
+        *enc_p++ = a;
+    }
+    else
+    {
+        *enc_p++ = a - 1;
+        *enc_p++ = b - ASSET_MIN_MATCH;
+    }
+    enc_bits++;
+}
+
+static void testAsset()
+{
+    static uint8_t blob[1024];
+    static char want[600];
+    struct asset_hdr_s h = { ASSET_MAGIC, 2, 0 };
+    struct asset_entry_s e[2];
+    uint8_t *p;
+    int i;
+
+    uint32_t frames = sim_frames;
+    int cs = flash_dev->cs;
+
+    // the minigame banner can come up before flash_init()
+    flash_dev->cs = -1;
+    CHECK(!asset_print(ASSET_INTRO) && sim_frames == frames, "asset before flash_init()");
+    flash_dev->cs = cs;
+
+    CHECK(!asset_print(ASSET_INTRO), "asset from erased flash");
+
+    // "abcabcabc" + 10 x '~': a match and an overlapping run
+    p = blob + sizeof(h) + sizeof(e);
+    enc_p = p;
+    enc_bits = 8;
+    encToken(1, 'a', 0);
+    encToken(1, 'b', 0);
+    encToken(1, 'c', 0);
+    encToken(0, 3, 6);
+    encToken(1, '~', 0);
+    encToken(0, 1, 9);
+    e[0].offset = p - blob;
+    e[0].size = 19;
+    e[0].packed = enc_p - p;
+
+    // 300 literals, then the longest match from the far end of the window
+    p = enc_p;
+    enc_bits = 8;
+    for (i = 0; i < 300; i++)
+    {
+        want[i] = 'A' + i % 53;
+        encToken(1, want[i], 0);
+    }
+    for (; i < 300 + 258; i++)
+    {
+        want[i] = want[i - ASSET_WINDOW];
+    }
+    encToken(0, ASSET_WINDOW, 258);
+    e[1].offset = p - blob;
+    e[1].size = i;
+    e[1].packed = enc_p - p;
+
+    memcpy(blob, &h, sizeof(h));
+    memcpy(blob + sizeof(h), e, sizeof(e));
+    flash_erase_range(ASSET_ADDR, sizeof(blob));
+    flash_write(ASSET_ADDR, blob, enc_p - blob);
+
+    uart_len = 0;
+    CHECK(asset_print(0), "asset 0");
+    CHECK(uart_len == 19 && !memcmp(uart, "abcabcabc~~~~~~~~~~", 19), "asset 0 is '%.*s'", uart_len, uart);
+
+    uart_len = 0;
+    CHECK(asset_print(1), "asset 1");
+    CHECK(uart_len == 558 && !memcmp(uart, want, 558), "asset 1 mismatch, %d bytes", uart_len);
+
+    CHECK(!asset_print(2), "asset past the end of the table");
+    printf("asset: %u packed bytes expand to %u\n", e[0].packed + e[1].packed, e[0].size + e[1].size);
+}
+
+// overlays.h stand-in, and src/overlay/stats.c built for the host
+struct overlay_entry_s overlay_table[2];
+int overlay_main(const struct overlay_api_s * api, void * arg);
+
+static void overlayDigest(const uint8_t * image, uint16_t size, uint8_t * h)
+{
+    struct AES_ctx ctx;
+    uint8_t e[AES_BLOCKLEN];
+
+    memset(h, 0, AES_BLOCKLEN);
+    for (unsigned i = 0; i < size; i += AES_BLOCKLEN)
+    {
+        memcpy(e, h, AES_BLOCKLEN);
+        AES_init_ctx(&ctx, image + i);
+        AES_ECB_encrypt(&ctx, e);
+        for (unsigned j = 0; j < AES_BLOCKLEN; j++)
+        {
+            h[j] ^= e[j];
+        }
+    }
+}
+
+static int overlayPrintf(const char * fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(uart + uart_len, sizeof(uart) - uart_len, fmt, ap);
+    va_end(ap);
+    uart_len += n;
+
+    return n;
+}
+
+static void testOverlay()
+{
+    // AES-128 of a zero block under a zero key, what pack_overlays.py
+    // gets for a 16 byte image of zeros
+    static const uint8_t zero_digest[AES_BLOCKLEN] = {
+        0x66, 0xe9, 0x4b, 0xd4, 0xef, 0x8a, 0x2c, 0x3b,
+        0x88, 0x4c, 0xfa, 0x59, 0xca, 0x34, 0x2b, 0x2e,
+    };
+    static uint8_t image[OVERLAY_SLOT_SIZE];
+    const struct overlay_api_s api = { .printf = overlayPrintf };
+    struct overlay_stats_s st = { .stats = &flash_stats, .clk_div = 8 };
+    struct overlay_entry_s *e = overlay_table;
+    uint8_t zero[16] = { 0 }, bad = 0;
+    uint32_t reads;
+    uint64_t start;
+    const void *fn;
+
+    CHECK(!overlay_load(0), "overlay without a table entry");
+    CHECK(overlay_call(0, NULL) == OVERLAY_MISSING, "overlay_call without a table entry");
+    CHECK(!overlay_load(2), "overlay past the end of the table");
+
+    flash_erase_range(OVERLAY_ADDR, 0x1000);
+    flash_write(OVERLAY_ADDR, zero, sizeof(zero));
+    e[0] = (struct overlay_entry_s){ 0, sizeof(zero) };
+    memcpy(e[0].digest, zero_digest, AES_BLOCKLEN);
+    fn = overlay_load(0);
+    CHECK(fn && !memcmp(fn, zero, sizeof(zero)), "overlay against a known digest");
+
+    // not a multiple of 16, the digest pads with zeros
+    for (unsigned i = 0; i < 500; i++)
+    {
+        image[i] = i * 7 + 3;
+    }
+    flash_write(OVERLAY_ADDR + 0x100, image, 500);
+    e[1] = (struct overlay_entry_s){ 0x100, 500 };
+    overlayDigest(image, sizeof(image), e[1].digest);
+
+    start = sim_cycles;
+    fn = overlay_load(1);
+    CHECK(fn && !memcmp(fn, image, 500), "overlay image");
+    printf("overlay: 500 byte load in %u us\n", elapsed_us(start));
+
+    // already in the slot, flash isn't even looked at
+    reads = w25q[0].stats.reads;
+    CHECK(overlay_load(1) == fn, "overlay reload");
+    CHECK(w25q[0].stats.reads == reads, "cached overlay read the chip %u times", w25q[0].stats.reads - reads);
+
+    // an image changed through the raw SPI commands doesn't run once it's
+    // read again. The slot copy was checked, so it stays.
+    flash_write(OVERLAY_ADDR + 0x100 + 10, &bad, 1);
+    CHECK(overlay_load(1) == fn, "overlay slot after a flash change");
+    CHECK(overlay_load(0), "overlay 0 after overlay 1");
+    CHECK(!overlay_load(1), "overlay that doesn't match its digest");
+    reads = w25q[0].stats.reads;
+    CHECK(!overlay_load(1) && w25q[0].stats.reads != reads, "failed overlay load was cached");
+
+    // the slot is empty, and nothing the host could run gets loaded again
+    memset(overlay_table, 0, sizeof(overlay_table));
+
+    uart_len = 0;
+    CHECK(overlay_main(&api, &st) == 0, "stats overlay");
+    CHECK(strstr(uart, "Update: ") && strstr(uart, "SPI: HCLK/8\r\n") && strstr(uart, "Cache: "),
+        "stats overlay printed '%.*s'", uart_len, uart);
+}
+
+static void testPowerDown()
+{
+    uint64_t start;
+    uint32_t us;
+
+    idle_ms(FLASH_PDOWN_IDLE_MS + 10);
+    CHECK(w25q_powered_down(0), "chip not powered down after idling");
+    CHECK(w25q_powered_down(1), "second chip not powered down after idling");
+
+    start = sim_cycles;
+    flash_read(0x200, buf, 64);
+    us = elapsed_us(start);
+    CHECK(!w25q_powered_down(0), "chip still powered down");
+    CHECK(!memcmp(buf, pattern + 0x200, 64), "read after wake mismatch");
+    printf("read 64 bytes from power-down: %u us\n", us);
+}
+
+#if FLASH_TRACE_ENTRIES
+// The erase, the wait before programming, the program, the wait the read
+// is forced into (it wants the page being programmed), the read
+static void testTrace()
+{
+    struct flash_trace_hdr_s h;
+    struct flash_trace_s t[5];
+    uint8_t read_op = (flash_get_read_mode() == FLASH_READ_NORMAL) ? 0x03 : 0x0B;
+    const uint8_t want[5] = { 0x52, 0x05, 0x02, 0x05, read_op };
+    const uint32_t want_len[5] = { 0x8000, 0, 16, 1, 64 };
+    uint32_t total, start, ticks;
+
+    uart_len = 0;
+    flash_trace_dump();
+    memcpy(&h, uart, sizeof(h));
+    CHECK(h.magic == FLASH_TRACE_MAGIC && h.size == sizeof(t[0]), "trace header");
+    total = h.total;
+
+    flash_erase_block(0x70000);
+    flash_write(0x70000, pattern, 16);
+    flash_read(0x70000, buf, 64);
+
+    uart_len = 0;
+    flash_trace_dump();
+    memcpy(&h, uart, sizeof(h));
+    CHECK(h.total - total == 5, "%u transactions traced, expected 5", h.total - total);
+    CHECK(uart_len == sizeof(h) + h.count * sizeof(t[0]), "trace dump is %d bytes", uart_len);
+    if (h.total - total != 5 || h.count < 5) return;
+
+    memcpy(t, uart + uart_len - sizeof(t), sizeof(t));
+    for (int i = 0; i < 5; i++)
+    {
+        CHECK(t[i].op_addr >> 24 == want[i], "trace %d: op 0x%02x, expected 0x%02x", i, t[i].op_addr >> 24, want[i]);
+        CHECK((t[i].op_addr & 0xFFFFFF) == 0x70000, "trace %d: addr 0x%x", i, t[i].op_addr & 0xFFFFFF);
+        // polls vary, the rest is exact
+        CHECK(t[i].len == want_len[i] || (want[i] == 0x05 && t[i].len), "trace %d: len %u", i, t[i].len);
+        CHECK(i == 0 || t[i].start - t[i - 1].start >= flash_trace_ticks(t[i - 1].dur),
+            "trace %d starts before %d ends", i, i - 1);
+    }
+    printf("trace: erase waited %u us, %u polls\n",
+        flash_trace_ticks(t[1].dur) / DELAY_US_TIME, t[1].len);
+
+    // the duration keeps 12 significant bits, the length saturates
+    start = SysTick->CNT;
+    Delay_Ms(2000);
+    flash_trace(0x06, 0, 0x12345, start);
+    uart_len = 0;
+    flash_trace_dump();
+    memcpy(t, uart + uart_len - sizeof(t[0]), sizeof(t[0]));
+    ticks = SysTick->CNT - start;
+    CHECK(t[0].len == 0xFFFF, "trace len %u", t[0].len);
+    CHECK(flash_trace_ticks(t[0].dur) <= ticks && flash_trace_ticks(t[0].dur) > ticks - (ticks >> 11),
+        "trace dur %u ticks for %u", flash_trace_ticks(t[0].dur), ticks);
+}
+#endif
+
+static void report()
+{
+    printf("\nmodel: %u commands, %u reads, %u programs, %u erases, %u suspends, %u sleeps\n",
+        w25q[0].stats.commands, w25q[0].stats.reads, w25q[0].stats.programs, w25q[0].stats.erases,
+        w25q[0].stats.suspends, w25q[0].stats.sleeps);
+    printf("bus: %u frames, %u ms virtual\n", sim_frames, (uint32_t)(sim_cycles / CYCLES_PER_US / 1000));
+
+    for (int i = 0; i < W25Q_CHIPS; i++)
+    {
+        struct w25q_stats_s *st = &w25q[i].stats;
+
+        CHECK(!st->ignored_busy, "chip %d: %u commands sent while busy", i, st->ignored_busy);
+        CHECK(!st->ignored_pdown, "chip %d: %u commands sent while powered down", i, st->ignored_pdown);
+        CHECK(!st->ignored_no_wel, "chip %d: %u program/erase without write enable", i, st->ignored_no_wel);
+        CHECK(!st->early_after_wake, "chip %d: %u commands within tRES1", i, st->early_after_wake);
+        CHECK(!st->program_0_to_1, "chip %d: %u bytes programmed over 0 bits", i, st->program_0_to_1);
+    }
+    CHECK(!sim_errors.spe_off, "%u frames with SPE clear", sim_errors.spe_off);
+    CHECK(!sim_errors.truncated, "%u 16 bit writes in 8 bit mode", sim_errors.truncated);
+    CHECK(!sim_errors.overrun, "%u RX overruns", sim_errors.overrun);
+    CHECK(!sim_errors.underrun, "%u RX underruns", sim_errors.underrun);
+    CHECK(!sim_errors.dff_while_enabled, "%u DFF changes while enabled", sim_errors.dff_while_enabled);
+    CHECK(!sim_errors.contention, "%u frames with two chips selected", sim_errors.contention);
+
+    printf("\n");
+    flash_print_stats();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+}
+
+int main(void)
+{
+    sim_reset();
+
+    testInit();
+    testProgram();
+#if FLASH_CALIBRATE
+    testCalibrate();
+#endif
+    testReadModes();
+    testSuspend();
+    testUpdate();
+    testJournal();
+    testKV();
+    testRecord();
+    testExt();
+    testOTP();
+    testWait();
+    testBlockErase();
+    testJobs();
+    testInterleave();
+    testAsset();
+    testOverlay();
+    testPowerDown();
+#if FLASH_TRACE_ENTRIES
+    testTrace();
+#endif
+#if FLASH_BENCH
+    printf("\nBENCH FLASH\n");
+    benchFlash();
+#endif
+    report();
+
+    return failures ? 1 : 0;
+}
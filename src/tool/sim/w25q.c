@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "w25q.h"
+
+#define SR1_BUSY 0x01
+#define SR1_WEL  0x02
+#define SR2_LB1  0x08     // LB2, LB3 above it
+#define SR2_SUS  0x80
+#define SR3_ADS  0x01
+
+struct w25q_s w25q[W25Q_CHIPS];
+
+static uint8_t sfdp[256];
+
+static void put32(uint8_t * p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// JESD216B header and Basic Flash Parameter Table as the W25Q128JV
+// reports them, 16 DWORDs so the suspend/resume DWORDs are there too
+static void sfdp_init(void)
+{
+    static const uint32_t bfpt[16] = {
+        0xFFF920E5,     // 4K erase 0x20, 3 byte addressing
+        0x07FFFFFF,     // 128 Mbit
+        0x6B08EB44,
+        0xBB423B08,
+        0xFFFFFFFE,
+        0xFF00FFFF,
+        0xEB40FFFF,
+        0x520F200C,     // 4K 0x20, 32K 0x52
+        0xFF00D810,     // 64K 0xD8
+        0xD90324A4,
+        0x00821882,
+        0x08D2CD14,     // suspend/resume supported
+        0x757A757A,     // erase suspend/resume, program suspend/resume
+        0xF7A2D5F7,
+        0x005CF919,
+        0x80E86143,
+    };
+
+    memset(sfdp, 0xFF, sizeof(sfdp));
+    memcpy(sfdp, "SFDP", 4);
+    sfdp[4] = 0x06;     // JESD216B
+    sfdp[5] = 0x01;
+    sfdp[6] = 0x00;     // one parameter header
+    sfdp[7] = 0xFF;
+    sfdp[8] = 0x00;     // BFPT, ID LSB
+    sfdp[9] = 0x06;
+    sfdp[10] = 0x01;
+    sfdp[11] = 16;
+    put32(&sfdp[12], 0xFF000080);       // PTP 0x80, ID MSB 0xFF
+    for (int i = 0; i < 16; i++)
+    {
+        put32(&sfdp[0x80 + i * 4], bfpt[i]);
+    }
+}
+
+void w25q_reset(void)
+{
+    sfdp_init();
+    for (int i = 0; i < W25Q_CHIPS; i++)
+    {
+        memset(&w25q[i], 0, sizeof(w25q[i]));
+        memset(w25q[i].mem, 0xFF, sizeof(w25q[i].mem));
+        memset(w25q[i].sec, 0xFF, sizeof(w25q[i].sec));
+    }
+}
+
+static void op_finish(struct w25q_s * c, struct op_s * o)
+{
+    uint8_t *dst;
+
+    switch (o->type)
+    {
+        case OP_PROGRAM:
+        case OP_SEC_PROGRAM:
+            dst = (o->type == OP_PROGRAM) ? &c->mem[o->addr & ~0xFFul] : c->sec[((o->addr >> 12) & 3) - 1];
+            for (int i = 0; i < 256; i++)
+            {
+                if (o->used[i] && (o->data[i] & ~dst[i]))
+                {
+                    c->stats.program_0_to_1++;
+                }
+                dst[i] &= o->data[i];
+            }
+            break;
+        case OP_ERASE:
+            memset(&c->mem[o->addr], 0xFF, o->len);
+            break;
+        case OP_SEC_ERASE:
+            memset(c->sec[((o->addr >> 12) & 3) - 1], 0xFF, 256);
+            break;
+    }
+    if (o->type != OP_SUSPEND)
+    {
+        c->wel = 0;
+    }
+    o->type = OP_NONE;
+}
+
+static void update(struct w25q_s * c, uint64_t now)
+{
+    if (c->active.type != OP_NONE && now >= c->active.end)
+    {
+        op_finish(c, &c->active);
+    }
+}
+
+int w25q_busy(int chip, uint64_t now)
+{
+    update(&w25q[chip], now);
+
+    return w25q[chip].active.type != OP_NONE;
+}
+
+int w25q_powered_down(int chip)
+{
+    return w25q[chip].pdown;
+}
+
+static uint8_t status1(struct w25q_s * c)
+{
+    return (c->active.type != OP_NONE ? SR1_BUSY : 0) | (c->wel ? SR1_WEL : 0);
+}
+
+static int addr_bytes(struct w25q_s * c, uint8_t op)
+{
+    switch (op)
+    {
+        case 0x03:
+        case 0x0B:
+        case 0x02:
+        case 0x20:
+        case 0x52:
+        case 0xD8:
+            return (c->sr3 & SR3_ADS) ? 4 : 3;
+        case 0x5A:
+        case 0x48:
+        case 0x42:
+        case 0x44:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static int dummy_bytes(uint8_t op)
+{
+    switch (op)
+    {
+        case 0x0B:
+        case 0x5A:
+        case 0x48:
+            return 1;
+        case 0xAB:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Commands the chip still listens to while an operation is running
+static int allowed_busy(uint8_t op)
+{
+    return op == 0x05 || op == 0x35 || op == 0x15 || op == 0x75;
+}
+
+static void start(struct w25q_s * c, int type, uint32_t a, uint32_t len, uint64_t t, uint64_t now)
+{
+    if (!c->wel)
+    {
+        c->stats.ignored_no_wel++;
+        return;
+    }
+    if ((type == OP_SEC_PROGRAM || type == OP_SEC_ERASE) && !((a >> 12) & 3))
+    {
+        return;
+    }
+    // locked security registers are read only for good
+    if ((type == OP_SEC_PROGRAM || type == OP_SEC_ERASE) && (c->sr2 & (SR2_LB1 << (((a >> 12) & 3) - 1))))
+    {
+        c->wel = 0;
+        return;
+    }
+    // only programs are allowed while an erase is suspended
+    if (c->suspended.type != OP_NONE && type != OP_PROGRAM && type != OP_SEC_PROGRAM)
+    {
+        c->stats.ignored_busy++;
+        return;
+    }
+    c->active.type = type;
+    c->active.addr = a;
+    c->active.len = len;
+    c->active.end = now + t;
+    if (type == OP_PROGRAM || type == OP_SEC_PROGRAM)
+    {
+        memcpy(c->active.data, c->page, sizeof(c->page));
+        memcpy(c->active.used, c->page_mask, sizeof(c->page_mask));
+        c->stats.programs++;
+    }
+    else
+    {
+        c->stats.erases++;
+    }
+}
+
+void w25q_cs(int chip, int level, uint64_t now)
+{
+    struct w25q_s *c = &w25q[chip];
+
+    update(c, now);
+
+    if (!level)
+    {
+        if (!c->selected)
+        {
+            c->selected = 1;
+            c->have_cmd = 0;
+            c->ignore = 0;
+            c->count = 0;
+            c->addr = 0;
+            c->page_used = 0;
+            memset(c->page, 0xFF, sizeof(c->page));
+            memset(c->page_mask, 0, sizeof(c->page_mask));
+        }
+        return;
+    }
+
+    if (!c->selected)
+    {
+        return;
+    }
+    c->selected = 0;
+    if (c->ignore || !c->have_cmd)
+    {
+        return;
+    }
+
+    // count is the number of bytes after the opcode, commands that take
+    // effect on CS rise need their full address
+    switch (c->cmd)
+    {
+        case 0x06:
+            c->wel = 1;
+            break;
+        case 0x04:
+            c->wel = 0;
+            break;
+        case 0x02:
+        case 0x42:
+            if (c->count > (uint32_t)addr_bytes(c, c->cmd) && c->page_used)
+            {
+                start(c, c->cmd == 0x02 ? OP_PROGRAM : OP_SEC_PROGRAM, c->addr & (W25Q_SIZE - 1), 256, W25Q_TPP_NS, now);
+            }
+            break;
+        case 0x20:
+            if (c->count >= (uint32_t)addr_bytes(c, c->cmd))
+            {
+                start(c, OP_ERASE, c->addr & ~0xFFFul & (W25Q_SIZE - 1), 0x1000, W25Q_TSE_NS, now);
+            }
+            break;
+        case 0x52:
+            if (c->count >= (uint32_t)addr_bytes(c, c->cmd))
+            {
+                start(c, OP_ERASE, c->addr & ~0x7FFFul & (W25Q_SIZE - 1), 0x8000, W25Q_TBE1_NS, now);
+            }
+            break;
+        case 0xD8:
+            if (c->count >= (uint32_t)addr_bytes(c, c->cmd))
+            {
+                start(c, OP_ERASE, c->addr & ~0xFFFFul & (W25Q_SIZE - 1), 0x10000, W25Q_TBE2_NS, now);
+            }
+            break;
+        case 0x44:
+            if (c->count >= 3)
+            {
+                start(c, OP_SEC_ERASE, c->addr, 256, W25Q_TSE_NS, now);
+            }
+            break;
+        case 0xC7:
+        case 0x60:
+            start(c, OP_ERASE, 0, W25Q_SIZE, W25Q_TCE_NS, now);
+            break;
+        case 0x75:
+            if ((c->active.type == OP_PROGRAM || c->active.type == OP_ERASE) && c->suspended.type == OP_NONE &&
+                !c->drop_suspend)
+            {
+                c->suspended = c->active;
+                c->suspended.left = c->active.end - now;
+                c->active.type = OP_SUSPEND;
+                c->active.end = now + W25Q_TSUS_NS;
+                c->sr2 |= SR2_SUS;
+                c->stats.suspends++;
+            }
+            break;
+        case 0x7A:
+            if (c->suspended.type != OP_NONE && c->active.type == OP_NONE)
+            {
+                c->active = c->suspended;
+                c->active.end = now + c->suspended.left;
+                c->suspended.type = OP_NONE;
+                c->sr2 &= ~SR2_SUS;
+                c->stats.resumes++;
+            }
+            break;
+        case 0xB9:
+            c->pdown = 1;
+            c->ready_at = now + W25Q_TDP_NS;
+            c->stats.sleeps++;
+            break;
+        case 0xAB:
+            if (c->pdown)
+            {
+                c->pdown = 0;
+                c->ready_at = now + W25Q_TRES1_NS;
+                c->stats.wakes++;
+            }
+            break;
+        case 0xB7:
+            c->sr3 |= SR3_ADS;
+            break;
+        case 0xE9:
+            c->sr3 &= ~SR3_ADS;
+            break;
+    }
+}
+
+static uint8_t xfer(struct w25q_s * c, uint8_t in, uint64_t now)
+{
+    static const uint8_t jedec_id[3] = { 0xEF, 0x40, 0x18 };
+    uint32_t n;
+    int na, nd, reg;
+
+    update(c, now);
+
+    if (!c->have_cmd)
+    {
+        c->cmd = in;
+        c->have_cmd = 1;
+        c->stats.commands++;
+        if (c->pdown)
+        {
+            if (c->cmd != 0xAB)
+            {
+                c->stats.ignored_pdown++;
+                c->ignore = 1;
+            }
+        }
+        else if (now < c->ready_at)
+        {
+            c->stats.early_after_wake++;
+            c->ignore = 1;
+        }
+        else if (c->active.type != OP_NONE && !allowed_busy(c->cmd))
+        {
+            if (c->cmd == 0x06)
+            {
+                c->stats.wren_while_busy++;
+            }
+            else
+            {
+                c->stats.ignored_busy++;
+            }
+            c->ignore = 1;
+        }
+        else if (c->cmd == 0x03 || c->cmd == 0x0B || c->cmd == 0x48 || c->cmd == 0x5A)
+        {
+            c->stats.reads++;
+        }
+        return 0xFF;
+    }
+
+    // MISO is high-Z for commands the chip isn't listening to
+    if (c->ignore)
+    {
+        return 0xFF;
+    }
+
+    n = c->count++;
+    na = addr_bytes(c, c->cmd);
+    if (n < (uint32_t)na)
+    {
+        c->addr = (c->addr << 8) | in;
+        return 0xFF;
+    }
+    n -= na;
+    nd = dummy_bytes(c->cmd);
+    if (n < (uint32_t)nd)
+    {
+        return 0xFF;
+    }
+    n -= nd;
+
+    switch (c->cmd)
+    {
+        case 0x9F:
+            return (n < 3) ? jedec_id[n] : 0x00;
+        case 0xAB:
+            return 0x17;
+        case 0x05:
+            return status1(c);
+        case 0x35:
+            return c->sr2;
+        case 0x15:
+            return c->sr3;
+        case 0x03:
+        case 0x0B:
+            return c->mem[(c->addr + n) & (W25Q_SIZE - 1)];
+        case 0x5A:
+            return sfdp[(c->addr + n) & 0xFF];
+        case 0x48:
+            reg = (c->addr >> 12) & 3;
+            return reg ? c->sec[reg - 1][(c->addr + n) & 0xFF] : 0xFF;
+        case 0x02:
+        case 0x42:
+            c->page[(c->addr + n) & 0xFF] = in;
+            c->page_mask[(c->addr + n) & 0xFF] = 1;
+            c->page_used = 1;
+            return 0xFF;
+    }
+
+    return 0xFF;
+}
+
+// Every selected chip sees the byte, MISO is the wired-AND of what they drive
+uint8_t w25q_xfer(uint8_t in, uint64_t now)
+{
+    uint8_t out = 0xFF;
+
+    for (int i = 0; i < W25Q_CHIPS; i++)
+    {
+        if (w25q[i].selected)
+        {
+            out &= xfer(&w25q[i], in, now);
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,98 @@
+#ifndef __W25Q_H__
+#define __W25Q_H__
+
+#include <stdint.h>
+
+// Behavioral model of a Winbond W25Q128JV. Time is passed in by the caller
+// in nanoseconds; busy times are the datasheet typical values. W25Q_CHIPS
+// of them share the bus, each with its own chip select.
+
+#define W25Q_SIZE       (16ul << 20)
+#define W25Q_CHIPS      2
+
+#define W25Q_TPP_NS     400000ull       // page program
+#define W25Q_TSE_NS     45000000ull     // 4K sector erase
+#define W25Q_TBE1_NS    120000000ull    // 32K block erase
+#define W25Q_TBE2_NS    150000000ull    // 64K block erase
+#define W25Q_TCE_NS     40000000000ull  // chip erase
+#define W25Q_TSUS_NS    20000ull        // suspend to ready
+#define W25Q_TRES1_NS   3000ull         // release from power-down
+#define W25Q_TDP_NS     3000ull         // enter power-down
+
+struct w25q_stats_s
+{
+    uint32_t commands;
+    uint32_t reads;             // 0x03 / 0x0B / 0x48 / 0x5A
+    uint32_t programs;
+    uint32_t erases;
+    uint32_t suspends;
+    uint32_t resumes;
+    uint32_t sleeps;
+    uint32_t wakes;
+    uint32_t wren_while_busy;   // harmless, the driver sends it for Micron
+    // driver mistakes
+    uint32_t ignored_busy;      // command other than status/suspend while busy
+    uint32_t ignored_pdown;     // command other than 0xAB while powered down
+    uint32_t ignored_no_wel;    // program/erase without write enable
+    uint32_t early_after_wake;  // command within tRES1 of 0xAB
+    uint32_t program_0_to_1;    // program tried to set bits that are 0
+};
+
+enum
+{
+    OP_NONE = 0,
+    OP_PROGRAM,
+    OP_ERASE,
+    OP_SEC_PROGRAM,
+    OP_SEC_ERASE,
+    OP_SUSPEND,     // between 0x75 and the chip being ready for reads
+};
+
+struct op_s
+{
+    int type;
+    uint64_t end;       // completion time while running
+    uint64_t left;      // remaining time while suspended
+    uint32_t addr;
+    uint32_t len;
+    uint8_t data[256];
+    uint8_t used[256];  // bytes the program actually sent
+};
+
+struct w25q_s
+{
+    struct w25q_stats_s stats;
+    uint8_t mem[W25Q_SIZE];
+    uint8_t sec[3][256];
+    uint8_t sr2, sr3;
+    int wel;
+    int pdown;
+    uint64_t ready_at;          // tRES1 after release from power-down
+    int drop_suspend;           // test hook, 0x75 is ignored
+    struct op_s active, suspended;
+    // current command
+    int selected;
+    int have_cmd;
+    int ignore;
+    uint8_t cmd;
+    uint32_t count;             // bytes after the opcode
+    uint32_t addr;
+    uint8_t page[256];
+    uint8_t page_mask[256];
+    int page_used;
+};
+
+extern struct w25q_s w25q[W25Q_CHIPS];
+
+void w25q_reset(void);
+
+void w25q_cs(int chip, int level, uint64_t now);
+
+// Clocks a byte into every selected chip
+uint8_t w25q_xfer(uint8_t in, uint64_t now);
+
+int w25q_busy(int chip, uint64_t now);
+
+int w25q_powered_down(int chip);
+
+#endif // __W25Q_H__
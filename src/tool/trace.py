@@ -0,0 +1,70 @@
+#!/usr/bin/python
+
+# Fetches the flash transaction trace (TRACE command) from the badge and
+# prints it, oldest first. The ring is struct flash_trace_s entries behind
+# a struct flash_trace_hdr_s, see src/include/flash.h.
+
+from struct import unpack
+import argparse
+
+from pack_assets import Badge, SERPORT
+
+MAGIC = b"TRCE"
+HDR_SIZE = 12
+
+OPS = {
+    0x02: "program", 0x03: "read", 0x05: "status", 0x06: "wren", 0x0B: "fast read",
+    0x15: "status 3", 0x35: "status 2",
+    0x20: "erase 4K", 0x52: "erase 32K", 0xD8: "erase 64K", 0xC7: "chip erase",
+    0x42: "sec program", 0x44: "sec erase", 0x48: "sec read", 0x5A: "sfdp",
+    0x70: "flags", 0x75: "suspend", 0x7A: "resume", 0x9F: "jedec id",
+    0xAB: "wake", 0xB9: "power down",
+}
+
+def fetch(badge):
+    badge.ser.write(b"TRACE\r\n")
+    badge.ser.read_until(MAGIC)
+    hdr = MAGIC + badge.ser.read(HDR_SIZE - len(MAGIC))
+    _, total, count, size, dur_bits, ticks_us = unpack("<4sIBBBB", hdr)
+    body = badge.ser.read(count * size)
+    badge.ser.read_until(b">> ")
+    if len(body) != count * size:
+        raise IOError(f"short trace, {len(body)} of {count * size} bytes")
+
+    return hdr + body
+
+def decode(raw):
+    magic, total, count, size, dur_bits, ticks_us = unpack("<4sIBBBB", raw[:HDR_SIZE])
+    if magic != MAGIC:
+        raise ValueError("not a trace dump")
+
+    print(f"{count} of {total} transactions")
+    print(f"{'start us':>12} {'took us':>9}  {'op':<14} {'addr':>8} {'len':>6}")
+    base = None
+    for i in range(count):
+        start, op_addr, length, dur = unpack("<IIHH", raw[HDR_SIZE + i * size:HDR_SIZE + i * size + 12])
+        base = start if base is None else base
+        op = op_addr >> 24
+        name = OPS.get(op, f"0x{op:02x}")
+        # exponent over a dur_bits mantissa, 0xffff is "that long or more"
+        took = ((dur & ((1 << dur_bits) - 1)) << (dur >> dur_bits)) / ticks_us
+        more = "+" if dur == 0xFFFF else " "
+        print(f"{((start - base) & 0xFFFFFFFF) / ticks_us:12.1f} {took:9.1f}{more} {name:<14} {op_addr & 0xFFFFFF:8x} {length:6}")
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser("Sword of Secrets flash trace")
+    parser.add_argument("--port", default = SERPORT, help = "badge serial port")
+    parser.add_argument("-f", "--file", help = "decode a saved dump instead")
+    parser.add_argument("-o", "--output", help = "also save the raw dump here")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, "rb") as f:
+            raw = f.read()
+    else:
+        raw = fetch(Badge(args.port))
+
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(raw)
+    decode(raw)